@@ -1,11 +1,14 @@
 //FINAL CODE
 
-#include <opencv2/opencv.hpp>
-#include <unordered_map>
-#include <vector>
+#include "clone_detector.h"
+#include "image_view.h"
+#include "result_cache.h"
+
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/highgui.hpp>
 #include <iostream>
-#include <sstream>
-#include <cmath>
+#include <string>
 
 using namespace cv;
 using namespace std;
@@ -16,6 +19,12 @@ int detailSlider = 97; // Slider value (detailThreshold = detailSlider / 10.0)
 int minDistSlider = 20;
 int clusterSlider = 3;
 int showQuantized = 0;
+int mergeReversed = 0; // cluster A->B and B->A copies together
+int showStats = 0;
+int matchAll = 0; // pair blocks with every earlier block of the same key
+int dctEngine = 0; // match DCT features instead of exact keys
+int pyramidSlider = 0; // coarse pass on a 2^n smaller copy first
+int keypointSlider = 0; // 1 = ORB, 2 = SIFT keypoints instead of blocks
 
 const int maxBlockSlider = 6; // up to 64 block size
 const int maxDetail = 200;    // corresponds to 20.0
@@ -23,187 +32,190 @@ const int maxZoom = 10;
 int zoomSlider = 1;
 int zoomSize = 200;
 
+CloneDetector detector;
+AsyncRenderer zoomRenderer; // zoom view off the GUI thread, newest cursor only
 Mat originalImage, annotatedImage, quantizedDisplay;
-
-struct ClonePair {
-    Point src;
-    Point dst;
-    Point displacement() const {
-        return Point(dst.x - src.x, dst.y - src.y);
+bool annotatedValid = false; // views are drawn lazily, when first shown
+bool quantizedValid = false;
+ResultCache resultCache;  // with --cache-dir: results of settings seen before
+uint64_t imageHash = 0;
+CloneResult cachedResult;
+bool usingCached = false; // the view shows cachedResult, not the detector's
+
+CloneParams sliderParams() {
+    CloneParams params;
+    params.blockSize = (1 << blockSlider);
+    params.stepSize = stepSlider;
+    params.detailThreshold = detailSlider / 10.0;
+    params.minDistance = minDistSlider;
+    params.matchMode = (matchAll == 1) ? MATCH_ALL : MATCH_FIRST;
+    params.matchEngine = (dctEngine == 1) ? ENGINE_DCT : ENGINE_HASH;
+    if (keypointSlider > 0) {
+        params.matchEngine = ENGINE_KEYPOINT;
+        params.keypointType = (keypointSlider == 2) ? KEYPOINT_SIFT : KEYPOINT_ORB;
     }
-};
-
-string blockToKey(const Mat& block, Mat& smallOut) {
-    Mat gray, small;
-    cvtColor(block, gray, COLOR_BGR2GRAY);
-    resize(gray, small, Size(4, 4));
-    smallOut = small.clone();
-    stringstream ss;
-    for (int i = 0; i < small.rows; i++) {
-        for (int j = 0; j < small.cols; j++) {
-            ss << (int)(small.at<uchar>(i, j) / 16) << ",";
-        }
-    }
-    return ss.str();
+    params.pyramidLevels = pyramidSlider;
+    params.minClusterSize = clusterSlider;
+    params.mergeReversed = (mergeReversed == 1);
+    return params;
 }
 
-double computeDetail(const Mat& block) {
-    Mat gray, lap;
-    cvtColor(block, gray, COLOR_BGR2GRAY);
-    Laplacian(gray, lap, CV_64F);
-    Scalar mu, sigma;
-    meanStdDev(lap, mu, sigma);
-    return sigma[0];
+const CloneResult& currentResult() {
+    return usingCached ? cachedResult : detector.result();
 }
 
-double euclideanDistance(Point a, Point b) {
-    return sqrt((a.x - b.x)*(a.x - b.x) + (a.y - b.y)*(a.y - b.y));
+// A cache hit leaves the detector as it was; its stages still match the
+// parameters it last ran with, so a later miss reruns only what changed
+void runDetection() {
+    CloneParams params = sliderParams();
+    usingCached = resultCache.load(imageHash, params, cachedResult);
+    if (usingCached)
+        return;
+    detector.detect(params);
+    resultCache.store(imageHash, params, detector.result());
 }
 
-vector<vector<ClonePair>> clusterClones(const vector<ClonePair>& pairs, int minClusterSize, double directionTolerance = 5.0) {
-    vector<vector<ClonePair>> clusters;
-    vector<bool> used(pairs.size(), false);
-
-    for (size_t i = 0; i < pairs.size(); i++) {
-        if (used[i]) continue;
-        vector<ClonePair> cluster = { pairs[i] };
-        used[i] = true;
-        Point refDisp = pairs[i].displacement();
-
-        for (size_t j = i + 1; j < pairs.size(); j++) {
-            if (used[j]) continue;
-            Point d = pairs[j].displacement();
-            if (abs(d.x - refDisp.x) <= directionTolerance && abs(d.y - refDisp.y) <= directionTolerance) {
-                cluster.push_back(pairs[j]);
-                used[j] = true;
+// Detector counters in the top-left corner, drawn on a copy of the view
+Mat withStats(const Mat& view) {
+    const CloneStats& st = currentResult().stats;
+    vector<string> lines = {
+        format("blocks %zu visited, %zu below detail", st.blocksVisited, st.blocksFiltered),
+        format("keys %zu unique, %zu repeated, %zu probes", st.uniqueKeys, st.keyCollisions, st.probeCollisions),
+        format("pairs %zu kept, %zu too close, clusters %zu", st.candidatePairs, st.rejectedByDistance, st.clustersKept),
+        format("ms pyramid %.1f detail %.1f keys %.1f scan %.1f match %.1f cluster %.1f",
+               st.pyramidMs, st.detailMs, st.keyMapMs, st.scanMs, st.matchMs, st.clusterMs)
+    };
+    Mat out = view.clone();
+    double scale = max(0.5, out.cols / 1600.0);
+    int lineHeight = (int)(22 * scale);
+    rectangle(out, Rect(0, 0, (int)(520 * scale), lineHeight * (int)lines.size() + lineHeight / 2),
+              Scalar(0, 0, 0), FILLED);
+    for (size_t i = 0; i < lines.size(); i++)
+        putText(out, lines[i], Point(8, lineHeight * (int)(i + 1)), FONT_HERSHEY_SIMPLEX, 0.5 * scale,
+                Scalar(0, 255, 0), max(1, (int)scale));
+    return out;
+}
+
+void showResult() {
+    Mat view;
+    if (showQuantized == 1) {
+        if (!quantizedValid) {
+            // The quantized view needs the scan, which the cache does not keep
+            if (usingCached) {
+                detector.detect(sliderParams());
+                usingCached = false;
             }
+            quantizedDisplay = detector.renderQuantized();
+            quantizedValid = true;
         }
-
-        if (cluster.size() >= minClusterSize) {
-            clusters.push_back(cluster);
+        view = quantizedDisplay;
+    } else {
+        if (!annotatedValid) {
+            annotatedImage = originalImage.clone();
+            drawClusters(annotatedImage, currentResult());
+            annotatedValid = true;
         }
+        view = annotatedImage;
     }
-    return clusters;
+    imshow("Clone Detector", showStats == 1 ? withStats(view) : view);
 }
 
-void detectClones() {
-    int blockSize = (1 << blockSlider);
-    double detailThreshold = detailSlider / 10.0;
-    int stepSize = stepSlider;
-    int minDistance = minDistSlider;
-    int minClusterSize = clusterSlider;
-
-    unordered_map<string, Point> blockMap;
-    vector<ClonePair> candidatePairs;
-
-    annotatedImage = originalImage.clone();
-    quantizedDisplay = originalImage.clone();
-
-    for (int y = 0; y <= originalImage.rows - blockSize; y += stepSize) {
-        for (int x = 0; x <= originalImage.cols - blockSize; x += stepSize) {
-            Rect roi(x, y, blockSize, blockSize);
-            Mat block = originalImage(roi);
-
-            double detail = computeDetail(block);
-            if (detail < detailThreshold)
-                continue;
-
-            Mat compressed;
-            string key = blockToKey(block, compressed);
-
-            if (blockMap.find(key) != blockMap.end()) {
-                Point orig = blockMap[key];
-                Point curr = Point(x, y);
-                if (euclideanDistance(orig, curr) < minDistance)
-                    continue;
-
-                candidatePairs.push_back({ orig, curr });
-            } else {
-                blockMap[key] = Point(x, y);
-            }
-
-            Mat avgBlock;
-            resize(compressed, avgBlock, Size(blockSize, blockSize), 0, 0, INTER_NEAREST);
-            cvtColor(avgBlock, avgBlock, COLOR_GRAY2BGR);
-            avgBlock.copyTo(quantizedDisplay(roi));
-        }
-    }
+// The detector reruns only the stages a changed slider feeds into
+void onDetectChange(int, void*) {
+    runDetection();
+    annotatedValid = false;
+    quantizedValid = false;
+    showResult();
+}
 
-    auto clusters = clusterClones(candidatePairs, minClusterSize);
-
-    for (const auto& cluster : clusters) {
-        for (const auto& pair : cluster) {
-            Rect srcRect(pair.src.x, pair.src.y, blockSize, blockSize);
-            Rect dstRect(pair.dst.x, pair.dst.y, blockSize, blockSize);
-            rectangle(annotatedImage, srcRect, Scalar(0, 255, 0), 2);
-            rectangle(annotatedImage, dstRect, Scalar(255, 0, 255), 2);
-            line(annotatedImage,
-                Point(pair.src.x + blockSize / 2, pair.src.y + blockSize / 2),
-                Point(pair.dst.x + blockSize / 2, pair.dst.y + blockSize / 2),
-                Scalar(255, 255, 255), 1);
-        }
-    }
+void onClusterChange(int, void*) {
+    runDetection();
+    annotatedValid = false;
+    showResult();
 }
 
-void onSliderChange(int, void*) {
-    detectClones();
-    if (showQuantized == 1) {
-        imshow("Clone Detector", quantizedDisplay);
-    } else {
-        imshow("Clone Detector", annotatedImage);
-    }
+void onViewChange(int, void*) {
+    showResult();
 }
 
 void onMouse(int event, int x, int y, int, void*) {
     if (event != EVENT_MOUSEMOVE)
         return;
 
-    int scale = zoomSlider;
-    if (scale < 1) scale = 1;
-
-    int cropSize = static_cast<int>(zoomSize / static_cast<double>(scale));
-    int x1 = max(0, min(x - cropSize / 2, originalImage.cols - cropSize));
-    int y1 = max(0, min(y - cropSize / 2, originalImage.rows - cropSize));
-
-    Rect roi(x1, y1, cropSize, cropSize);
-    Mat cropped = originalImage(roi);
-
-    Mat zoomed;
-    resize(cropped, zoomed, Size(zoomSize, zoomSize), 0, 0, INTER_LINEAR);
+    // originalImage is never written after loading, so the worker may share it
+    Mat image = originalImage;
+    int zoom = zoomSlider, size = zoomSize;
+    zoomRenderer.post(Point(x, y), [image, zoom, size, x, y] {
+        return magnify(image, Point(x, y), zoom, size);
+    });
+}
 
-    moveWindow("Zoom View", x + 20, y + 20);
-    imshow("Zoom View", zoomed);
+// With Show Stats, the zoom view also shows its render time and latency
+void showZoomFrame(AsyncRenderer::Frame& frame) {
+    if (showStats == 1)
+        drawFrameTiming(frame.image, frame);
+    moveWindow("Zoom View", frame.anchor.x + 20, frame.anchor.y + 20);
+    imshow("Zoom View", frame.image);
 }
 
-int main() {
-    originalImage = imread("/Users/bishesh/Desktop/Intern/opencv-setup/combined.png");
+int main(int argc, char** argv) {
+    string imagePath = "/Users/bishesh/Desktop/Intern/opencv-setup/combined.png";
+    string cacheDir;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--cache-dir" && i + 1 < argc)
+            cacheDir = argv[++i];
+        else
+            imagePath = arg;
+    }
+    originalImage = imread(imagePath);
     if (originalImage.empty()) {
-        cerr << "Could not open image" << endl;
+        cerr << "Could not open image " << imagePath << endl;
         return -1;
     }
+    detector.setImage(originalImage);
+    if (!cacheDir.empty()) {
+        if (resultCache.open(cacheDir))
+            imageHash = ResultCache::imageHash(originalImage);
+        else
+            cerr << "Could not open cache " << cacheDir << "; running without it" << endl;
+    }
 
     namedWindow("Clone Detector", WINDOW_AUTOSIZE);
     namedWindow("Zoom View", WINDOW_NORMAL);
     resizeWindow("Zoom View", zoomSize, zoomSize);
     setMouseCallback("Clone Detector", onMouse);
 
-    createTrackbar("Show Quantized", "Clone Detector", &showQuantized, 1, onSliderChange);
-    createTrackbar("Block Size (2^n)", "Clone Detector", &blockSlider, maxBlockSlider, onSliderChange);
-    createTrackbar("Step Size", "Clone Detector", &stepSlider, 20, onSliderChange);
-    createTrackbar("Detail Threshold", "Clone Detector", &detailSlider, maxDetail, onSliderChange);
-    createTrackbar("Min Distance", "Clone Detector", &minDistSlider, 100, onSliderChange);
-    createTrackbar("Cluster Size", "Clone Detector", &clusterSlider, 10, onSliderChange);
+    createTrackbar("Show Quantized", "Clone Detector", &showQuantized, 1, onViewChange);
+    createTrackbar("Show Stats", "Clone Detector", &showStats, 1, onViewChange);
+    createTrackbar("Block Size (2^n)", "Clone Detector", &blockSlider, maxBlockSlider, onDetectChange);
+    createTrackbar("Step Size", "Clone Detector", &stepSlider, 20, onDetectChange);
+    createTrackbar("Detail Threshold", "Clone Detector", &detailSlider, maxDetail, onDetectChange);
+    createTrackbar("Min Distance", "Clone Detector", &minDistSlider, 100, onDetectChange);
+    createTrackbar("Match All", "Clone Detector", &matchAll, 1, onDetectChange);
+    createTrackbar("DCT Engine", "Clone Detector", &dctEngine, 1, onDetectChange);
+    createTrackbar("Pyramid Levels", "Clone Detector", &pyramidSlider, 3, onDetectChange);
+    createTrackbar("Keypoints (ORB/SIFT)", "Clone Detector", &keypointSlider, 2, onDetectChange);
+    createTrackbar("Cluster Size", "Clone Detector", &clusterSlider, 10, onClusterChange);
+    createTrackbar("Merge Reversed", "Clone Detector", &mergeReversed, 1, onClusterChange);
     createTrackbar("Zoom (1x-10x)", "Clone Detector", &zoomSlider, maxZoom);
 
-    detectClones();
-    imshow("Clone Detector", annotatedImage);
-
-    waitKey(0);
+    runDetection();
+    showResult();
+
+    // Polls for finished zoom frames until ESC or the window is closed
+    while (true) {
+        int key = waitKey(5);
+        if (key == 27 || getWindowProperty("Clone Detector", WND_PROP_VISIBLE) < 1)
+            break;
+        AsyncRenderer::Frame frame;
+        if (zoomRenderer.take(frame))
+            showZoomFrame(frame);
+    }
     return 0;
 }
 
 
-
 // #include <opencv2/opencv.hpp>
 // #include <unordered_map>
 // #include <vector>
@@ -0,0 +1,363 @@
+#include "clone_detector.h"
+#include "strip_reader.h"
+#include "video_detector.h"
+#include "report_json.h"
+#include "result_cache.h"
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/videoio.hpp>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <memory>
+
+using namespace cv;
+using namespace std;
+
+// Headless clone detection: no HighGUI, parameters from the command line, one
+// JSON report and one tamper mask per input image.
+
+void printUsage() {
+    cerr << "usage: clone_batch [options] <image>...\n"
+         << "  --block N           block size in pixels (default 4)\n"
+         << "  --step N            block step in pixels (default 4)\n"
+         << "  --detail X          minimal block detail (default 9.7)\n"
+         << "  --min-distance N    minimal source/copy distance (default 20)\n"
+         << "  --cluster-size N    minimal pairs per cluster (default 3)\n"
+         << "  --merge-reversed    cluster A->B and B->A copies together\n"
+         << "  --engine NAME       hash (exact block keys), dct or keypoint (default hash)\n"
+         << "  --pyramid N         find clusters on a 2^N smaller copy first, then scan\n"
+         << "                      only around them (default 0 = off)\n"
+         << "  --matcher NAME      table or radix: how hash keys are matched (default table)\n"
+         << "  --dct-window N      sorted DCT rows compared per block (default 8)\n"
+         << "  --dct-tolerance N   largest DCT coefficient difference (default 1)\n"
+         << "  --keypoints NAME    keypoint engine: orb or sift (default orb)\n"
+         << "  --max-keypoints N   keypoint engine: strongest keypoints kept (default 20000)\n"
+         << "  --g2nn X            keypoint engine: g2NN distance ratio (default 0.5)\n"
+         << "  --cluster-radius X  keypoint engine: distance within which matches\n"
+         << "                      cluster together (default 50)\n"
+         << "  --match-all         pair blocks with every earlier block of the same key\n"
+         << "  --max-occurrences N blocks kept per key with --match-all (default 16)\n"
+         << "  --threads N         concurrent tasks in the scan and matching, 0 = all CPUs (default 0)\n"
+         << "  --stream            decode PNM and TIFF images in strips; no mask is written\n"
+         << "  --memory-mb N       strip memory budget for --stream (default 256)\n"
+         << "  --video             inputs are videos; report clusters per frame range\n"
+         << "  --tile N            --video: change detection tile size (default 64)\n"
+         << "  --change X          --video: mean gray difference that marks a tile\n"
+         << "                      changed and re-keys its blocks (default 2.0)\n"
+         << "  --cache-dir DIR     reuse results stored in DIR for the same pixels and\n"
+         << "                      parameters, and store new ones there\n"
+         << "  --cache-mb N        cache size limit, least recently used results are\n"
+         << "                      evicted first (default 1024)\n"
+         << "  --stats             add detector counters to each report and print them\n"
+         << "                      to stdout, one JSON record per image\n"
+         << "  --list FILE         read further image paths from FILE, - for stdin\n"
+         << "  --out DIR           output directory (default .)\n"
+         << "Writes <name>.json and <name>_mask.png per image, only <name>.json per\n"
+         << "video. Exit status is 0 if no clusters were found, 1 if any input has\n"
+         << "clusters, 2 on errors.\n";
+}
+
+void writeVideoStats(ostream& out, const VideoStats& st, double decodeMs) {
+    out << "{\"frames\": " << st.frames
+        << ", \"tilesChanged\": " << st.tilesChanged
+        << ", \"tilesTotal\": " << st.tilesTotal
+        << ", \"blocksRekeyed\": " << st.blocksRekeyed
+        << ", \"blocksTotal\": " << st.blocksTotal
+        << ", \"stageMs\": {\"decode\": " << decodeMs << ", \"change\": " << st.changeMs
+        << ", \"rekey\": " << st.rekeyMs << ", \"match\": " << st.matchMs
+        << ", \"cluster\": " << st.clusterMs << "}}";
+}
+
+void writeReport(ostream& out, const string& imagePath, Size size,
+                 const CloneParams& params, const CloneResult& result, bool withStats) {
+    out << "{\n"
+        << "  \"image\": \"" << jsonEscape(imagePath) << "\",\n"
+        << "  \"width\": " << size.width << ",\n"
+        << "  \"height\": " << size.height << ",\n"
+        << "  \"params\": ";
+    writeParams(out, params);
+    out << ",\n"
+        << "  \"candidatePairs\": " << result.candidatePairs.size() << ",\n";
+    if (withStats) {
+        out << "  \"stats\": ";
+        writeStats(out, result.stats);
+        out << ",\n";
+    }
+    out << "  \"clusters\": ";
+    writeClusters(out, result.clusters, "  ");
+    out << "\n}\n";
+}
+
+void writeVideoReport(ostream& out, const string& videoPath, Size size,
+                      const VideoCloneDetector& detector, double decodeMs, bool withStats) {
+    const VideoParams& params = detector.params();
+    out << "{\n"
+        << "  \"video\": \"" << jsonEscape(videoPath) << "\",\n"
+        << "  \"width\": " << size.width << ",\n"
+        << "  \"height\": " << size.height << ",\n"
+        << "  \"frames\": " << detector.stats().frames << ",\n"
+        << "  \"params\": ";
+    writeParams(out, params.clone);
+    out << ",\n"
+        << "  \"tileSize\": " << params.tileSize << ",\n"
+        << "  \"changeThreshold\": " << params.changeThreshold << ",\n";
+    if (withStats) {
+        out << "  \"stats\": ";
+        writeVideoStats(out, detector.stats(), decodeMs);
+        out << ",\n";
+    }
+    out << "  \"segments\": [";
+    const auto& segments = detector.segments();
+    for (size_t s = 0; s < segments.size(); s++) {
+        out << (s ? ",\n" : "\n")
+            << "    {\"firstFrame\": " << segments[s].firstFrame
+            << ", \"lastFrame\": " << segments[s].lastFrame << ", \"clusters\": ";
+        writeClusters(out, segments[s].clusters, "    ");
+        out << "}";
+    }
+    out << (segments.empty() ? "]\n" : "\n  ]\n") << "}\n";
+}
+
+// Decodes every frame into a VideoCloneDetector and writes its report
+bool processVideo(const string& path, const string& stem, const VideoParams& params,
+                  bool printStats, bool& anyClusters) {
+    VideoCapture capture(path);
+    if (!capture.isOpened()) {
+        cerr << "Could not open video " << path << endl;
+        return false;
+    }
+    VideoCloneDetector detector(params);
+    Mat frame;
+    Size size;
+    double decodeMs = 0;
+    while (true) {
+        int64 t = getTickCount();
+        if (!capture.read(frame) || frame.empty())
+            break;
+        decodeMs += (getTickCount() - t) * 1000.0 / getTickFrequency();
+        size = frame.size();
+        detector.addFrame(frame);
+    }
+
+    ofstream report(stem + ".json");
+    writeVideoReport(report, path, size, detector, decodeMs, printStats);
+    if (!report) {
+        cerr << "Could not write results for " << path << endl;
+        return false;
+    }
+    if (printStats) {
+        cout << "{\"video\": \"" << jsonEscape(path) << "\", \"stats\": ";
+        writeVideoStats(cout, detector.stats(), decodeMs);
+        cout << "}" << endl;
+    }
+    anyClusters = anyClusters || !detector.segments().empty();
+    return true;
+}
+
+int main(int argc, char** argv) {
+    CloneParams params;
+    vector<string> images;
+    string outDir = ".";
+    bool printStats = false;
+    bool stream = false;
+    bool video = false;
+    VideoParams videoParams;
+    size_t memoryBudget = (size_t)256 << 20;
+    string cacheDir;
+    size_t cacheBudget = (size_t)1024 << 20;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--merge-reversed") {
+            params.mergeReversed = true;
+        } else if (arg == "--engine" && hasValue) {
+            string name = argv[++i];
+            if (name != "hash" && name != "dct" && name != "keypoint") {
+                cerr << "Unknown engine " << name << endl;
+                return 2;
+            }
+            params.matchEngine = (name == "dct") ? ENGINE_DCT : (name == "keypoint") ? ENGINE_KEYPOINT : ENGINE_HASH;
+        } else if (arg == "--keypoints" && hasValue) {
+            string name = argv[++i];
+            if (name != "orb" && name != "sift") {
+                cerr << "Unknown keypoint type " << name << endl;
+                return 2;
+            }
+            params.keypointType = (name == "sift") ? KEYPOINT_SIFT : KEYPOINT_ORB;
+        } else if (arg == "--max-keypoints" && hasValue) {
+            params.maxKeypoints = max(1, atoi(argv[++i]));
+        } else if (arg == "--g2nn" && hasValue) {
+            params.g2nnRatio = atof(argv[++i]);
+        } else if (arg == "--cluster-radius" && hasValue) {
+            params.clusterRadius = atof(argv[++i]);
+        } else if (arg == "--pyramid" && hasValue) {
+            params.pyramidLevels = max(0, atoi(argv[++i]));
+        } else if (arg == "--matcher" && hasValue) {
+            string name = argv[++i];
+            if (name != "table" && name != "radix") {
+                cerr << "Unknown matcher " << name << endl;
+                return 2;
+            }
+            params.keyMatcher = (name == "radix") ? MATCHER_RADIX_SORT : MATCHER_HASH_TABLE;
+        } else if (arg == "--dct-window" && hasValue) {
+            params.dctWindow = atoi(argv[++i]);
+        } else if (arg == "--dct-tolerance" && hasValue) {
+            params.dctTolerance = atoi(argv[++i]);
+        } else if (arg == "--match-all") {
+            params.matchMode = MATCH_ALL;
+        } else if (arg == "--max-occurrences" && hasValue) {
+            params.maxOccurrences = atoi(argv[++i]);
+        } else if (arg == "--stats") {
+            printStats = true;
+        } else if (arg == "--stream") {
+            stream = true;
+        } else if (arg == "--video") {
+            video = true;
+        } else if (arg == "--tile" && hasValue) {
+            videoParams.tileSize = atoi(argv[++i]);
+        } else if (arg == "--change" && hasValue) {
+            videoParams.changeThreshold = atof(argv[++i]);
+        } else if (arg == "--memory-mb" && hasValue) {
+            memoryBudget = (size_t)max(1, atoi(argv[++i])) << 20;
+        } else if (arg == "--cache-dir" && hasValue) {
+            cacheDir = argv[++i];
+        } else if (arg == "--cache-mb" && hasValue) {
+            cacheBudget = (size_t)max(1, atoi(argv[++i])) << 20;
+        } else if (arg == "--block" && hasValue) {
+            params.blockSize = atoi(argv[++i]);
+        } else if (arg == "--step" && hasValue) {
+            params.stepSize = atoi(argv[++i]);
+        } else if (arg == "--detail" && hasValue) {
+            params.detailThreshold = atof(argv[++i]);
+        } else if (arg == "--min-distance" && hasValue) {
+            params.minDistance = atoi(argv[++i]);
+        } else if (arg == "--cluster-size" && hasValue) {
+            params.minClusterSize = atoi(argv[++i]);
+        } else if (arg == "--threads" && hasValue) {
+            params.threads = atoi(argv[++i]);
+        } else if (arg == "--out" && hasValue) {
+            outDir = argv[++i];
+        } else if (arg == "--list" && hasValue) {
+            string listPath = argv[++i];
+            ifstream listFile;
+            if (listPath != "-") {
+                listFile.open(listPath);
+                if (!listFile) {
+                    cerr << "Could not open list " << listPath << endl;
+                    return 2;
+                }
+            }
+            istream& in = (listPath == "-") ? cin : listFile;
+            string line;
+            while (getline(in, line)) {
+                if (!line.empty())
+                    images.push_back(line);
+            }
+        } else if (arg == "-h" || arg == "--help") {
+            printUsage();
+            return 0;
+        } else if (!arg.empty() && arg[0] == '-') {
+            cerr << "Unknown option " << arg << endl;
+            printUsage();
+            return 2;
+        } else {
+            images.push_back(arg);
+        }
+    }
+    if (images.empty()) {
+        printUsage();
+        return 2;
+    }
+    if (params.blockSize < 1 || params.stepSize < 1) {
+        cerr << "Block and step size must be positive" << endl;
+        return 2;
+    }
+    if (stream && params.matchMode == MATCH_ALL)
+        cerr << "--match-all is not available with --stream; matching first occurrences" << endl;
+    if (stream && params.matchEngine != ENGINE_HASH)
+        cerr << "--engine dct and keypoint are not available with --stream; using hash" << endl;
+    if (video && (stream || params.matchMode == MATCH_ALL || params.matchEngine != ENGINE_HASH
+                  || params.keyMatcher == MATCHER_RADIX_SORT || params.pyramidLevels > 0))
+        cerr << "--video matches first occurrences of exact keys only; ignoring --stream, "
+             << "--match-all, --engine, --matcher and --pyramid" << endl;
+    if (video && videoParams.tileSize < 1) {
+        cerr << "Tile size must be positive" << endl;
+        return 2;
+    }
+    videoParams.clone = params;
+    if (!cacheDir.empty() && (stream || video))
+        cerr << "--cache-dir is not available with --stream or --video; not caching" << endl;
+    ResultCache cache;
+    if (!cacheDir.empty() && !stream && !video && !cache.open(cacheDir, cacheBudget)) {
+        cerr << "Could not open cache " << cacheDir << endl;
+        return 2;
+    }
+
+    CloneDetector detector;
+    bool anyClusters = false, anyErrors = false;
+    for (const string& path : images) {
+        if (video) {
+            if (!processVideo(path, outDir + "/" + imageStem(path), videoParams, printStats, anyClusters))
+                anyErrors = true;
+            continue;
+        }
+        // A file seen before with a cached result is not even decoded
+        uint64_t hash = 0;
+        Size size;
+        CloneResult cached;
+        bool fromCache = cache.lookupSource(path, hash, size) && cache.load(hash, params, cached);
+
+        Mat image;
+        unique_ptr<StripReader> reader;
+        if (stream)
+            reader = openStripReader(path);
+        else if (!fromCache)
+            image = imread(path, IMREAD_COLOR);
+        if (stream ? !reader : (!fromCache && image.empty())) {
+            cerr << "Could not open image " << path << endl;
+            anyErrors = true;
+            continue;
+        }
+        if (stream) {
+            if (!reader->streams())
+                cerr << "warning: " << path << " cannot be decoded in strips and is loaded whole; "
+                     << "--memory-mb does not bound it" << endl;
+            size = reader->size();
+            detector.detectStream(*reader, params, memoryBudget);
+        } else if (!fromCache) {
+            size = image.size();
+            if (cache.isOpen()) {
+                hash = ResultCache::imageHash(image);
+                cache.rememberSource(path, hash, size);
+                fromCache = cache.load(hash, params, cached);
+            }
+            if (!fromCache) {
+                detector.setImage(image);
+                detector.detect(params);
+                cache.store(hash, params, detector.result());
+            }
+        }
+        const CloneResult& result = fromCache ? cached : detector.result();
+
+        // A full-size mask would defeat the memory budget of --stream
+        string stem = outDir + "/" + imageStem(path);
+        ofstream report(stem + ".json");
+        // The stream path overrides some settings; report the ones it used
+        writeReport(report, path, size, stream ? detector.params() : params, result, printStats);
+        if (!report || (!stream && !imwrite(stem + "_mask.png", tamperMask(size, result)))) {
+            cerr << "Could not write results for " << path << endl;
+            anyErrors = true;
+        }
+        if (printStats) {
+            cout << "{\"image\": \"" << jsonEscape(path) << "\", \"stats\": ";
+            writeStats(cout, result.stats);
+            cout << "}" << endl;
+        }
+        anyClusters = anyClusters || !result.clusters.empty();
+    }
+    return anyErrors ? 2 : (anyClusters ? 1 : 0);
+}
@@ -0,0 +1,385 @@
+#include "clone_detector.h"
+#include "synthetic.h"
+
+#include <opencv2/imgproc.hpp>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+// Per-stage benchmark of the detection pipeline on synthetic copy-move images.
+// Each stage runs single-threaded on its own so regressions can be pinned to
+// it; the full detector is then timed for every requested thread count.
+
+void printUsage() {
+    cerr << "usage: clone_bench [options]\n"
+         << "  --sizes LIST        image sizes, megapixels at 4:3 or WxH (default 1,3840x2160,12,24,50,100)\n"
+         << "  --blocks LIST       block sizes in pixels (default 8,16,32)\n"
+         << "  --steps LIST        step sizes in pixels (default 2,4,8)\n"
+         << "  --threads LIST      thread counts for the full detector (default 1,2,4,... up to all CPUs)\n"
+         << "  --detail X          detail threshold (default 9.7)\n"
+         << "  --pyramid N         pyramid levels for the coarse-to-fine runs (default 2)\n"
+         << "  --seed N            image generator seed (default 1)\n"
+         << "  --json FILE         write results as JSON (default clone_bench.json)\n";
+}
+
+vector<double> parseList(const string& text) {
+    vector<double> values;
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ','))
+        values.push_back(atof(item.c_str()));
+    return values;
+}
+
+// Megapixels become 4:3 images, the shape of most camera output
+vector<Size> parseSizes(const string& text) {
+    vector<Size> sizes;
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t x = item.find('x');
+        if (x != string::npos) {
+            sizes.push_back(Size(atoi(item.c_str()), atoi(item.c_str() + x + 1)));
+        } else {
+            double mp = atof(item.c_str());
+            int width = (int)round(sqrt(mp * 1e6 * 4.0 / 3.0));
+            sizes.push_back(Size(width, (int)round(mp * 1e6 / width)));
+        }
+    }
+    return sizes;
+}
+
+double elapsedMs(int64 start) {
+    return (getTickCount() - start) * 1000.0 / getTickFrequency();
+}
+
+// Process-wide high-water mark, so it only grows from run to run
+double peakRssMB() {
+#ifdef _WIN32
+    return 0.0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+struct StageTimes {
+    double detail = 0, keys = 0, sampledKeys = 0, lookup = 0, cluster = 0, draw = 0;
+    double legacy = 0; // keys and lookup with string keys in an unordered_map
+};
+
+struct BenchRun {
+    double megapixels = 0;
+    Size size;
+    CloneParams params;
+    size_t positions = 0, detailPassed = 0, candidates = 0, clusters = 0;
+    StageTimes ms;
+    vector<pair<int, double>> detectMs; // thread count, full detect() time
+    double dctMs = 0;                   // full detect() with ENGINE_DCT, all threads
+    double keypointMs = 0;              // full detect() with ENGINE_KEYPOINT (ORB)
+    vector<pair<int, double>> tableMatchMs, radixMatchMs; // thread count, match stage time
+    // All threads: full and coarse-to-fine detect() on the forged and on a
+    // clean image, and the share of the full run's mask the pyramid run found
+    double forgedMs = 0, forgedPyramidMs = 0, cleanMs = 0, cleanPyramidMs = 0;
+    double pyramidRecall = 0;
+    double peakRss = 0;
+};
+
+// The key format blockToKey() replaced: the same quantized values as a
+// comma-separated string, kept to measure the packed keys against
+string legacyBlockKey(const Mat& block, Mat& smallOut) {
+    Mat gray, small;
+    cvtColor(block, gray, COLOR_BGR2GRAY);
+    resize(gray, small, Size(4, 4));
+    smallOut = small.clone();
+    stringstream ss;
+    for (int i = 0; i < small.rows; i++) {
+        for (int j = 0; j < small.cols; j++) {
+            ss << (int)(small.at<uchar>(i, j) / 16) << ",";
+        }
+    }
+    return ss.str();
+}
+
+BenchRun runStages(const Mat& image, const CloneParams& params) {
+    BenchRun run;
+    run.size = image.size();
+    run.params = params;
+    int bs = params.blockSize, step = params.stepSize;
+
+    int64 t = getTickCount();
+    DetailMap detailMap;
+    detailMap.compute(image);
+    vector<Point> passed;
+    for (int y = 0; y <= image.rows - bs; y += step) {
+        for (int x = 0; x <= image.cols - bs; x += step) {
+            run.positions++;
+            if (detailMap.blockDetail(x, y, bs) >= params.detailThreshold)
+                passed.push_back(Point(x, y));
+        }
+    }
+    run.ms.detail = elapsedMs(t);
+    run.detailPassed = passed.size();
+
+    t = getTickCount();
+    vector<uint64_t> keys(passed.size());
+    Mat compressed;
+    for (size_t i = 0; i < passed.size(); i++)
+        keys[i] = blockToKey(image(Rect(passed[i].x, passed[i].y, bs, bs)), compressed);
+    run.ms.keys = elapsedMs(t);
+
+    // Sample map engine, including building the map; must give the same keys
+    if (SampleMap::supports(bs)) {
+        t = getTickCount();
+        SampleMap sampleMap;
+        sampleMap.compute(image, SampleMap::windowFor(bs));
+        uchar cells[16];
+        size_t mismatches = 0;
+        for (size_t i = 0; i < passed.size(); i++)
+            mismatches += sampleMap.blockKey(passed[i].x, passed[i].y, bs, cells) != keys[i];
+        run.ms.sampledKeys = elapsedMs(t);
+        if (mismatches)
+            cerr << "warning: " << mismatches << " sample map keys differ from blockToKey()\n";
+    }
+
+    t = getTickCount();
+    BlockTable table;
+    table.reserve(min(passed.size(), (size_t)1 << 22));
+    vector<ClonePair> candidates;
+    for (size_t i = 0; i < passed.size(); i++) {
+        Point first;
+        if (table.findOrInsert(keys[i], passed[i], first)
+            && euclideanDistance(first, passed[i]) >= params.minDistance)
+            candidates.push_back({ first, passed[i] });
+    }
+    run.ms.lookup = elapsedMs(t);
+    run.candidates = candidates.size();
+
+    // One pass as the old loop did, so the strings are not all held at once
+    t = getTickCount();
+    unordered_map<string, Point> legacyMap;
+    size_t legacyCandidates = 0;
+    for (size_t i = 0; i < passed.size(); i++) {
+        string key = legacyBlockKey(image(Rect(passed[i].x, passed[i].y, bs, bs)), compressed);
+        auto found = legacyMap.find(key);
+        if (found == legacyMap.end())
+            legacyMap[key] = passed[i];
+        else if (euclideanDistance(found->second, passed[i]) >= params.minDistance)
+            legacyCandidates++;
+    }
+    run.ms.legacy = elapsedMs(t);
+    if (legacyCandidates != candidates.size())
+        cerr << "warning: string keys gave " << legacyCandidates << " candidates, packed keys "
+             << candidates.size() << "\n";
+
+    t = getTickCount();
+    CloneResult result;
+    result.blockSize = bs;
+    result.clusters = clusterClones(candidates, params.minClusterSize, params.directionTolerance);
+    run.ms.cluster = elapsedMs(t);
+    run.clusters = result.clusters.size();
+
+    t = getTickCount();
+    Mat annotated = image.clone();
+    drawClusters(annotated, result);
+    run.ms.draw = elapsedMs(t);
+    return run;
+}
+
+double timedDetect(CloneDetector& detector, const Mat& image, const CloneParams& params) {
+    detector.setImage(image);
+    int64 t = getTickCount();
+    detector.detect(params);
+    return elapsedMs(t);
+}
+
+// Pixels of the full-resolution mask that the coarse-to-fine run also marks
+double maskRecall(const Mat& found, const Mat& reference) {
+    int total = countNonZero(reference);
+    if (total == 0)
+        return 1.0;
+    Mat both;
+    bitwise_and(found, reference, both);
+    return (double)countNonZero(both) / total;
+}
+
+double perSecond(size_t count, double ms) {
+    return ms > 0 ? count * 1000.0 / ms : 0.0;
+}
+
+void writeJson(ostream& out, const vector<BenchRun>& runs) {
+    out << "{\n"
+        << "  \"opencv\": \"" << CV_VERSION << "\",\n"
+        << "  \"cpus\": " << getNumberOfCPUs() << ",\n"
+        << "  \"runs\": [";
+    for (size_t i = 0; i < runs.size(); i++) {
+        const BenchRun& r = runs[i];
+        out << (i ? ",\n" : "\n")
+            << "    {\"megapixels\": " << r.megapixels
+            << ", \"width\": " << r.size.width << ", \"height\": " << r.size.height
+            << ", \"blockSize\": " << r.params.blockSize << ", \"stepSize\": " << r.params.stepSize
+            << ", \"positions\": " << r.positions << ", \"detailPassed\": " << r.detailPassed
+            << ", \"candidates\": " << r.candidates << ", \"clusters\": " << r.clusters << ",\n"
+            << "     \"stageMs\": {\"detail\": " << r.ms.detail << ", \"keys\": " << r.ms.keys
+            << ", \"sampledKeys\": " << r.ms.sampledKeys
+            << ", \"lookup\": " << r.ms.lookup << ", \"cluster\": " << r.ms.cluster
+            << ", \"draw\": " << r.ms.draw << ", \"legacyKeysAndLookup\": " << r.ms.legacy << "},\n"
+            << "     \"blocksPerSec\": {\"detail\": " << perSecond(r.positions, r.ms.detail)
+            << ", \"keys\": " << perSecond(r.detailPassed, r.ms.keys)
+            << ", \"sampledKeys\": " << perSecond(r.detailPassed, r.ms.sampledKeys)
+            << ", \"lookup\": " << perSecond(r.detailPassed, r.ms.lookup)
+            << ", \"keysAndLookup\": " << perSecond(r.detailPassed, r.ms.keys + r.ms.lookup)
+            << ", \"legacyKeysAndLookup\": " << perSecond(r.detailPassed, r.ms.legacy) << "},\n"
+            << "     \"detectMs\": {";
+        for (size_t k = 0; k < r.detectMs.size(); k++)
+            out << (k ? ", " : "") << "\"" << r.detectMs[k].first << "\": " << r.detectMs[k].second;
+        out << "},\n     \"matchMs\": {\"table\": {";
+        for (size_t k = 0; k < r.tableMatchMs.size(); k++)
+            out << (k ? ", " : "") << "\"" << r.tableMatchMs[k].first << "\": " << r.tableMatchMs[k].second;
+        out << "}, \"radix\": {";
+        for (size_t k = 0; k < r.radixMatchMs.size(); k++)
+            out << (k ? ", " : "") << "\"" << r.radixMatchMs[k].first << "\": " << r.radixMatchMs[k].second;
+        out << "}},\n     \"pyramid\": {\"forgedMs\": " << r.forgedMs << ", \"forgedPyramidMs\": " << r.forgedPyramidMs
+            << ", \"cleanMs\": " << r.cleanMs << ", \"cleanPyramidMs\": " << r.cleanPyramidMs
+            << ", \"recall\": " << r.pyramidRecall << "}";
+        out << ", \"dctDetectMs\": " << r.dctMs << ", \"keypointDetectMs\": " << r.keypointMs
+            << ", \"peakRssMB\": " << r.peakRss << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char** argv) {
+    vector<Size> sizes = parseSizes("1,3840x2160,12,24,50,100");
+    vector<double> blocks = { 8, 16, 32 };
+    vector<double> steps = { 2, 4, 8 };
+    vector<double> threads;
+    double detailThreshold = 9.7;
+    uint64_t seed = 1;
+    int pyramidLevels = 2;
+    string jsonPath = "clone_bench.json";
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--sizes" && hasValue) {
+            sizes = parseSizes(argv[++i]);
+        } else if (arg == "--blocks" && hasValue) {
+            blocks = parseList(argv[++i]);
+        } else if (arg == "--steps" && hasValue) {
+            steps = parseList(argv[++i]);
+        } else if (arg == "--threads" && hasValue) {
+            threads = parseList(argv[++i]);
+        } else if (arg == "--detail" && hasValue) {
+            detailThreshold = atof(argv[++i]);
+        } else if (arg == "--pyramid" && hasValue) {
+            pyramidLevels = max(1, atoi(argv[++i]));
+        } else if (arg == "--seed" && hasValue) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--json" && hasValue) {
+            jsonPath = argv[++i];
+        } else {
+            printUsage();
+            return (arg == "-h" || arg == "--help") ? 0 : 2;
+        }
+    }
+    if (threads.empty()) {
+        for (int n = 1; n < getNumberOfCPUs(); n *= 2)
+            threads.push_back(n);
+        threads.push_back(getNumberOfCPUs());
+    }
+
+    vector<BenchRun> runs;
+    for (Size size : sizes) {
+        double mp = size.area() / 1e6;
+        SyntheticForgery forgery = makeSyntheticForgery(size, 3, seed);
+        SyntheticForgery clean = makeSyntheticForgery(size, 0, seed);
+
+        for (double block : blocks) {
+            for (double step : steps) {
+                CloneParams params;
+                params.blockSize = (int)block;
+                params.stepSize = (int)step;
+                params.detailThreshold = detailThreshold;
+
+                BenchRun run = runStages(forgery.image, params);
+                run.megapixels = mp;
+                for (double n : threads) {
+                    params.threads = (int)n;
+                    CloneDetector detector;
+                    detector.setImage(forgery.image);
+                    int64 t = getTickCount();
+                    const CloneResult& result = detector.detect(params);
+                    run.detectMs.push_back({ (int)n, elapsedMs(t) });
+                    run.tableMatchMs.push_back({ (int)n, result.stats.matchMs });
+
+                    params.keyMatcher = MATCHER_RADIX_SORT;
+                    run.radixMatchMs.push_back({ (int)n, detector.detect(params).stats.matchMs });
+                    params.keyMatcher = MATCHER_HASH_TABLE;
+                }
+                params.threads = 0;
+                CloneDetector full, pyramid;
+                CloneParams pyramidParams = params;
+                pyramidParams.pyramidLevels = pyramidLevels;
+                run.forgedMs = timedDetect(full, forgery.image, params);
+                run.forgedPyramidMs = timedDetect(pyramid, forgery.image, pyramidParams);
+                run.pyramidRecall = maskRecall(tamperMask(forgery.image.size(), pyramid.result()),
+                                               tamperMask(forgery.image.size(), full.result()));
+                run.cleanMs = timedDetect(full, clean.image, params);
+                run.cleanPyramidMs = timedDetect(pyramid, clean.image, pyramidParams);
+
+                CloneDetector dctDetector;
+                params.matchEngine = ENGINE_DCT;
+                run.dctMs = timedDetect(dctDetector, forgery.image, params);
+                CloneDetector keypointDetector;
+                params.matchEngine = ENGINE_KEYPOINT;
+                run.keypointMs = timedDetect(keypointDetector, forgery.image, params);
+                run.peakRss = peakRssMB();
+                runs.push_back(run);
+
+                cerr << format("%6.1f MP  block %3d  step %2d  detail %8.1f  keys %8.1f  sampled %7.1f"
+                               "  lookup %7.1f  cluster %7.1f  draw %6.1f ms  %.0f MB\n",
+                               mp, params.blockSize, params.stepSize, run.ms.detail, run.ms.keys,
+                               run.ms.sampledKeys, run.ms.lookup, run.ms.cluster, run.ms.draw, run.peakRss);
+                cerr << format("          keys + lookup %.1f ms, with string keys and unordered_map %.1f ms\n",
+                               run.ms.keys + run.ms.lookup, run.ms.legacy);
+                cerr << "          detect()";
+                for (const auto& d : run.detectMs)
+                    cerr << format("  %dT %.1f ms (x%.2f)", d.first, d.second,
+                                   run.detectMs[0].second / max(d.second, 1e-3));
+                cerr << format("  dct %.1f ms  keypoint %.1f ms\n", run.dctMs, run.keypointMs);
+                cerr << format("          pyramid %d: forged %.1f -> %.1f ms, clean %.1f -> %.1f ms, recall %.3f\n",
+                               pyramidLevels, run.forgedMs, run.forgedPyramidMs, run.cleanMs,
+                               run.cleanPyramidMs, run.pyramidRecall);
+                cerr << "          match table/radix";
+                for (size_t k = 0; k < run.tableMatchMs.size(); k++)
+                    cerr << format("  %dT %.1f/%.1f ms", run.tableMatchMs[k].first,
+                                   run.tableMatchMs[k].second, run.radixMatchMs[k].second);
+                cerr << "\n";
+            }
+        }
+    }
+
+    ofstream json(jsonPath);
+    writeJson(json, runs);
+    if (!json) {
+        cerr << "Could not write " << jsonPath << endl;
+        return 1;
+    }
+    return 0;
+}
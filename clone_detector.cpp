@@ -0,0 +1,912 @@
+#include "clone_detector.h"
+#include "strip_reader.h"
+#include "dct_matcher.h"
+#include "radix_matcher.h"
+#include "keypoint_matcher.h"
+
+#include <opencv2/imgproc.hpp>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+uint64_t blockToKey(const Mat& block, Mat& smallOut) {
+    Mat gray, small;
+    cvtColor(block, gray, COLOR_BGR2GRAY);
+    resize(gray, small, Size(4, 4));
+    smallOut = small.clone();
+    uint64_t key = 0;
+    for (int i = 0; i < small.rows; i++) {
+        for (int j = 0; j < small.cols; j++) {
+            key = (key << 4) | (small.at<uchar>(i, j) / 16);
+        }
+    }
+    return key;
+}
+
+double computeDetail(const Mat& block) {
+    Mat gray, lap;
+    cvtColor(block, gray, COLOR_BGR2GRAY);
+    Laplacian(gray, lap, CV_64F);
+    Scalar mu, sigma;
+    meanStdDev(lap, mu, sigma);
+    return sigma[0];
+}
+
+// The Laplacian with ksize 1 of an 8-bit image is integer valued, so CV_32F
+// holds it exactly and the CV_64F integrals stay exact up to ~8 gigapixels.
+void DetailMap::compute(const Mat& image) {
+    Mat gray, lap;
+    cvtColor(image, gray, COLOR_BGR2GRAY);
+    Laplacian(gray, lap, CV_32F);
+    integral(lap, lapSum, lapSqSum, CV_64F, CV_64F);
+}
+
+// Same statistic as computeDetail() in O(1). Tolerance: interior pixels are
+// identical, but the block's outer one-pixel ring sees its real neighbours
+// instead of computeDetail()'s reflected block border. Blocks whose detail is
+// close to the threshold can therefore flip; for 4px blocks every pixel is on
+// the ring. Use DETAIL_PER_BLOCK to reproduce results of the old engine.
+double DetailMap::blockDetail(int x, int y, int blockSize) const {
+    int x2 = x + blockSize, y2 = y + blockSize;
+    double n = (double)blockSize * blockSize;
+    double s = lapSum.at<double>(y2, x2) - lapSum.at<double>(y, x2)
+             - lapSum.at<double>(y2, x) + lapSum.at<double>(y, x);
+    double sq = lapSqSum.at<double>(y2, x2) - lapSqSum.at<double>(y, x2)
+              - lapSqSum.at<double>(y2, x) + lapSqSum.at<double>(y, x);
+    double var = (n * sq - s * s) / (n * n);
+    return var > 0 ? sqrt(var) : 0.0;
+}
+
+void SampleMap::compute(const Mat& image, int windowSize, int threads) {
+    Mat gray;
+    cvtColor(image, gray, COLOR_BGR2GRAY);
+    window = windowSize;
+    if (window == 1) {
+        samples = gray;
+        return;
+    }
+    // Same rounding as resize's fixed-point bilinear and INTER_AREA paths
+    samples = Mat::zeros(gray.size(), CV_8U); // last row and column stay unused
+    parallel_for_(Range(0, gray.rows - 1), [&](const Range& r) {
+        for (int y = r.start; y < r.end; y++) {
+            const uchar* a = gray.ptr<uchar>(y);
+            const uchar* b = gray.ptr<uchar>(y + 1);
+            uchar* out = samples.ptr<uchar>(y);
+            for (int x = 0; x < gray.cols - 1; x++)
+                out[x] = (uchar)((a[x] + a[x + 1] + b[x] + b[x + 1] + 2) >> 2);
+        }
+    }, threads > 0 ? (double)threads : -1.0);
+}
+
+uint64_t SampleMap::blockKey(int x, int y, int blockSize, uchar cells[16]) const {
+    int cell = blockSize / 4;
+    int offset = (cell - window) / 2;
+    uint64_t key = 0;
+    for (int i = 0; i < 4; i++) {
+        const uchar* row = samples.ptr<uchar>(y + i * cell + offset) + x + offset;
+        for (int j = 0; j < 4; j++) {
+            uchar v = row[j * cell];
+            cells[i * 4 + j] = v;
+            key = (key << 4) | (v >> 4);
+        }
+    }
+    return key;
+}
+
+double euclideanDistance(Point a, Point b) {
+    return sqrt((a.x - b.x)*(a.x - b.x) + (a.y - b.y)*(a.y - b.y));
+}
+
+void BlockTable::reserve(size_t n) {
+    size_t capacity = 16;
+    while (capacity < 2 * n)
+        capacity <<= 1;
+    if (capacity <= slots.size())
+        return;
+    vector<Slot> old;
+    old.swap(slots);
+    slots.assign(capacity, Slot{ 0, -1, -1 });
+    mask = capacity - 1;
+    for (const Slot& s : old) {
+        if (s.x < 0) continue;
+        size_t i = mix(s.key) & mask;
+        while (slots[i].x >= 0)
+            i = (i + 1) & mask;
+        slots[i] = s;
+    }
+}
+
+void BlockTable::clear() {
+    fill(slots.begin(), slots.end(), Slot{ 0, -1, -1 });
+    count = 0;
+    probes = 0;
+}
+
+bool BlockTable::find(uint64_t key, Point& first) const {
+    if (slots.empty())
+        return false;
+    size_t i = mix(key) & mask;
+    while (slots[i].x >= 0) {
+        if (slots[i].key == key) {
+            first = Point(slots[i].x, slots[i].y);
+            return true;
+        }
+        i = (i + 1) & mask;
+    }
+    return false;
+}
+
+bool BlockTable::findOrInsert(uint64_t key, Point pos, Point& first) {
+    if (2 * (count + 1) > slots.size())
+        reserve(count + 1);
+    size_t i = mix(key) & mask;
+    while (slots[i].x >= 0) {
+        if (slots[i].key == key) {
+            first = Point(slots[i].x, slots[i].y);
+            return true;
+        }
+        probes++;
+        i = (i + 1) & mask;
+    }
+    slots[i] = Slot{ key, pos.x, pos.y };
+    count++;
+    return false;
+}
+
+void OccurrenceIndex::build(vector<ScanBand>& bands, int maxPerKey) {
+    size_t records = 0;
+    for (const auto& band : bands)
+        records += band.records.size();
+    buckets.clear();
+    buckets.reserve(min(records, (size_t)1 << 22));
+
+    // Count per key, capped; the rank of each record doubles as its slot
+    vector<int> counts;
+    for (auto& band : bands) {
+        band.ranks.resize(band.records.size());
+        for (size_t i = 0; i < band.records.size(); i++) {
+            Point found;
+            int id = (int)counts.size();
+            if (buckets.findOrInsert(band.records[i].key, Point(id, 0), found))
+                id = found.x;
+            else
+                counts.push_back(0);
+            band.ranks[i] = (counts[id] < maxPerKey) ? counts[id]++ : -1;
+        }
+    }
+
+    offsets.assign(counts.size() + 1, 0);
+    for (size_t b = 0; b < counts.size(); b++)
+        offsets[b + 1] = offsets[b] + counts[b];
+    positions.resize(offsets.back());
+    for (const auto& band : bands) {
+        for (size_t i = 0; i < band.records.size(); i++) {
+            if (band.ranks[i] < 0) continue;
+            int id = bucket(band.records[i].key);
+            positions[offsets[id] + band.ranks[i]] = band.records[i].pos;
+        }
+    }
+}
+
+int OccurrenceIndex::bucket(uint64_t key) const {
+    Point found;
+    return buckets.find(key, found) ? found.x : -1;
+}
+
+static int floorDiv(int a, int b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static uint64_t cellKey(int cx, int cy) {
+    return ((uint64_t)(uint32_t)cx << 32) | (uint32_t)cy;
+}
+
+vector<vector<ClonePair>> clusterClones(const vector<ClonePair>& pairs, int minClusterSize,
+                                        double directionTolerance, bool normalizeSign) {
+    vector<vector<ClonePair>> clusters;
+    vector<bool> used(pairs.size(), false);
+    int cellSize = max(1, (int)floor(directionTolerance) + 1);
+
+    vector<pair<uint64_t, int>> order(pairs.size());
+    for (size_t i = 0; i < pairs.size(); i++) {
+        Point d = pairs[i].displacement();
+        order[i] = { cellKey(floorDiv(d.x, cellSize), floorDiv(d.y, cellSize)), (int)i };
+    }
+    sort(order.begin(), order.end());
+
+    // Cells as ranges of members, each range in ascending pair order
+    vector<uint64_t> cellKeys;
+    vector<int> cellBegin, cellEnd, members(order.size());
+    for (size_t k = 0; k < order.size(); k++) {
+        if (k == 0 || order[k].first != order[k - 1].first) {
+            cellKeys.push_back(order[k].first);
+            cellBegin.push_back((int)k);
+            cellEnd.push_back((int)k);
+        }
+        members[k] = order[k].second;
+        cellEnd.back()++;
+    }
+
+    vector<pair<int, bool>> found; // pair index, joined reversed
+    auto collect = [&](Point center, bool reversed) {
+        int cx = floorDiv(center.x, cellSize), cy = floorDiv(center.y, cellSize);
+        for (int gy = cy - 1; gy <= cy + 1; gy++) {
+            for (int gx = cx - 1; gx <= cx + 1; gx++) {
+                uint64_t key = cellKey(gx, gy);
+                auto it = lower_bound(cellKeys.begin(), cellKeys.end(), key);
+                if (it == cellKeys.end() || *it != key) continue;
+                size_t c = it - cellKeys.begin();
+
+                // Drop used members while scanning so cells shrink over time
+                int live = cellBegin[c];
+                for (int k = cellBegin[c]; k < cellEnd[c]; k++) {
+                    int j = members[k];
+                    if (used[j]) continue;
+                    Point d = pairs[j].displacement();
+                    if (abs(d.x - center.x) <= directionTolerance && abs(d.y - center.y) <= directionTolerance) {
+                        found.push_back({ j, reversed });
+                        used[j] = true;
+                    } else {
+                        members[live++] = j;
+                    }
+                }
+                cellEnd[c] = live;
+            }
+        }
+    };
+
+    for (size_t i = 0; i < pairs.size(); i++) {
+        if (used[i]) continue;
+        used[i] = true;
+        Point refDisp = pairs[i].displacement();
+
+        // Every index below i is already used, so only later pairs are found
+        found.clear();
+        collect(refDisp, false);
+        if (normalizeSign)
+            collect(-refDisp, true);
+        sort(found.begin(), found.end());
+
+        if ((int)found.size() + 1 < minClusterSize)
+            continue;
+        vector<ClonePair> cluster = { pairs[i] };
+        cluster.reserve(found.size() + 1);
+        for (const auto& f : found) {
+            const ClonePair& p = pairs[f.first];
+            cluster.push_back(f.second ? ClonePair{ p.dst, p.src } : p);
+        }
+        clusters.push_back(cluster);
+    }
+    return clusters;
+}
+
+void drawClusters(Mat& image, const CloneResult& result) {
+    int blockSize = result.blockSize;
+    for (const auto& cluster : result.clusters) {
+        for (const auto& pair : cluster) {
+            Rect srcRect(pair.src.x, pair.src.y, blockSize, blockSize);
+            Rect dstRect(pair.dst.x, pair.dst.y, blockSize, blockSize);
+            rectangle(image, srcRect, Scalar(0, 255, 0), 2);
+            rectangle(image, dstRect, Scalar(255, 0, 255), 2);
+            line(image,
+                Point(pair.src.x + blockSize / 2, pair.src.y + blockSize / 2),
+                Point(pair.dst.x + blockSize / 2, pair.dst.y + blockSize / 2),
+                Scalar(255, 255, 255), 1);
+        }
+    }
+}
+
+Mat tamperMask(Size size, const CloneResult& result) {
+    int blockSize = result.blockSize;
+    Mat mask = Mat::zeros(size, CV_8U);
+    for (const auto& cluster : result.clusters) {
+        for (const auto& pair : cluster) {
+            rectangle(mask, Rect(pair.src.x, pair.src.y, blockSize, blockSize), Scalar(255), FILLED);
+            rectangle(mask, Rect(pair.dst.x, pair.dst.y, blockSize, blockSize), Scalar(255), FILLED);
+        }
+    }
+    return mask;
+}
+
+static double elapsedMs(int64 start) {
+    return (getTickCount() - start) * 1000.0 / getTickFrequency();
+}
+
+int workerCount(const CloneParams& params) {
+    return params.threads > 0 ? params.threads : max(1, getNumThreads());
+}
+
+double parallelStripes(const CloneParams& params, int n) {
+    return params.threads > 0 ? (double)min(n, params.threads) : (double)n;
+}
+
+void CloneDetector::setImage(const Mat& image) {
+    image_ = image;
+    originY_ = 0;
+    sampleMap_.window = 0;
+    coarseImage_.release();
+    blockMask_.release();
+    dirtyStage_ = STAGE_DETAIL;
+    detailReady_ = false;
+}
+
+void CloneDetector::prepareMaps(const CloneParams& params) {
+    int blockSize = max(1, params.blockSize);
+    if (params.detailEngine == DETAIL_INTEGRAL && !detailReady_) {
+        detailMap_.compute(image_);
+        detailReady_ = true;
+    }
+    if (params.matchEngine == ENGINE_HASH && params.keyEngine == KEY_SAMPLE_MAP && SampleMap::supports(blockSize)
+        && sampleMap_.window != SampleMap::windowFor(blockSize))
+        sampleMap_.compute(image_, SampleMap::windowFor(blockSize), params.threads);
+}
+
+void CloneDetector::shareMaps(const CloneDetector& source) {
+    if (source.image_.data != image_.data || source.image_.size() != image_.size() || originY_ != 0)
+        return;
+    if (source.detailReady_) {
+        detailMap_ = source.detailMap_;
+        detailReady_ = true;
+    }
+    if (source.sampleMap_.window != 0)
+        sampleMap_ = source.sampleMap_;
+}
+
+void CloneDetector::scanBand(ScanBand& band) const {
+    int blockSize = params_.blockSize;
+    int stepSize = params_.stepSize;
+    int blockCols = (image_.cols - blockSize) / stepSize + 1;
+    band.records.clear();
+    band.firstSeen.clear();
+    band.visited = 0;
+    bool useSampleMap = params_.keyEngine == KEY_SAMPLE_MAP && SampleMap::supports(blockSize);
+    // The radix sort matcher needs no per-band tables
+    bool useTable = params_.keyMatcher == MATCHER_HASH_TABLE;
+    if (useTable)
+        band.firstSeen.reserve(min((size_t)(band.lastRow - band.firstRow) * blockCols, (size_t)1 << 20));
+
+    for (int row = band.firstRow; row < band.lastRow; row++) {
+        int y = row * stepSize;
+        int localY = y - originY_;
+        const uchar* maskRow = blockMask_.empty() ? nullptr : blockMask_.ptr<uchar>(row);
+        for (int x = 0; x <= image_.cols - blockSize; x += stepSize) {
+            if (maskRow && !maskRow[x / stepSize])
+                continue;
+            Rect roi(x, localY, blockSize, blockSize);
+            Mat block = image_(roi);
+            band.visited++;
+
+            double detail = (params_.detailEngine == DETAIL_INTEGRAL)
+                ? detailMap_.blockDetail(x, localY, blockSize)
+                : computeDetail(block);
+            if (detail < params_.detailThreshold)
+                continue;
+
+            BlockRecord rec;
+            rec.pos = Point(x, y);
+            if (useSampleMap) {
+                rec.key = sampleMap_.blockKey(x, localY, blockSize, rec.cells);
+            } else {
+                Mat compressed;
+                rec.key = blockToKey(block, compressed);
+                memcpy(rec.cells, compressed.data, sizeof(rec.cells));
+            }
+
+            Point first;
+            if (useTable)
+                band.firstSeen.findOrInsert(rec.key, rec.pos, first);
+            band.records.push_back(rec);
+        }
+    }
+}
+
+// Detail filtering as in scanBand(), then DCT features of the kept blocks.
+// Coefficient maps cover a few block rows at a time to bound their memory.
+void CloneDetector::scanBandDct(ScanBand& band, const DctBasis& basis) const {
+    const int chunkRows = 16;
+    int blockSize = params_.blockSize;
+    int stepSize = params_.stepSize;
+    band.records.clear();
+    band.firstSeen.clear();
+    band.dctPos.clear();
+    band.dctRows.clear();
+    band.visited = 0;
+
+    vector<Point> local;
+    for (int first = band.firstRow; first < band.lastRow; first += chunkRows) {
+        int last = min(first + chunkRows, band.lastRow);
+        int top = first * stepSize - originY_;
+        local.clear();
+        for (int row = first; row < last; row++) {
+            int localY = row * stepSize - originY_;
+            const uchar* maskRow = blockMask_.empty() ? nullptr : blockMask_.ptr<uchar>(row);
+            for (int x = 0; x <= image_.cols - blockSize; x += stepSize) {
+                if (maskRow && !maskRow[x / stepSize])
+                    continue;
+                band.visited++;
+                double detail = (params_.detailEngine == DETAIL_INTEGRAL)
+                    ? detailMap_.blockDetail(x, localY, blockSize)
+                    : computeDetail(image_(Rect(x, localY, blockSize, blockSize)));
+                if (detail < params_.detailThreshold)
+                    continue;
+                local.push_back(Point(x, localY - top));
+                band.dctPos.push_back(Point(x, row * stepSize));
+            }
+        }
+        if (local.empty())
+            continue;
+        Mat gray;
+        int bottom = (last - 1) * stepSize - originY_ + blockSize;
+        cvtColor(image_.rowRange(top, bottom), gray, COLOR_BGR2GRAY);
+        extractDctFeatures(gray, basis, local, band.dctRows);
+    }
+}
+
+// The raster scan runs in horizontal bands on OpenCV's thread pool. Each band
+// records its blocks and the first occurrence of every key; merging those
+// tables in band order yields the globally first occurrence, so candidatePairs
+// is identical to a single-threaded scan for any number of bands.
+void CloneDetector::scanBlocks(int firstRow, int lastRow) {
+    int blockRows = lastRow - firstRow;
+    int bandCount = (params_.bands > 0) ? params_.bands : workerCount(params_) * 4;
+    bandCount = max(1, min(bandCount, blockRows));
+
+    bands_.resize(bandCount);
+    for (int b = 0; b < bandCount; b++) {
+        bands_[b].firstRow = firstRow + (int)((int64)blockRows * b / bandCount);
+        bands_[b].lastRow = firstRow + (int)((int64)blockRows * (b + 1) / bandCount);
+    }
+
+    bool dct = params_.matchEngine == ENGINE_DCT;
+    DctBasis basis;
+    if (dct)
+        basis.init(params_.blockSize, params_.dctCoefficients, params_.dctQuantStep);
+    parallel_for_(Range(0, bandCount), [&](const Range& r) {
+        for (int b = r.start; b < r.end; b++) {
+            if (dct)
+                scanBandDct(bands_[b], basis);
+            else
+                scanBand(bands_[b]);
+        }
+    }, parallelStripes(params_, bandCount));
+
+    CloneStats& stats = result_.stats;
+    for (const auto& band : bands_) {
+        stats.blocksVisited += band.visited;
+        stats.blocksFiltered += band.visited - (dct ? band.dctPos.size() : band.records.size());
+    }
+}
+
+// Adds the bands' first occurrences to blockMap_; keys already there keep
+// their earlier position
+void CloneDetector::mergeBands() {
+    size_t uniqueKeys = blockMap_.count;
+    for (const auto& band : bands_)
+        uniqueKeys += band.firstSeen.count;
+    blockMap_.reserve(min(uniqueKeys, (size_t)1 << 22));
+    for (const auto& band : bands_) {
+        for (const auto& slot : band.firstSeen.slots) {
+            if (slot.x < 0) continue;
+            Point first;
+            blockMap_.findOrInsert(slot.key, Point(slot.x, slot.y), first);
+        }
+    }
+}
+
+// Replaces candidatePairs with the DCT engine's pairs
+void CloneDetector::matchDct() {
+    vector<Point> positions;
+    vector<short> rows;
+    for (const auto& band : bands_) {
+        positions.insert(positions.end(), band.dctPos.begin(), band.dctPos.end());
+        rows.insert(rows.end(), band.dctRows.begin(), band.dctRows.end());
+    }
+    int length = positions.empty() ? 0 : (int)(rows.size() / positions.size());
+
+    DctMatchStats dctStats;
+    result_.candidatePairs = matchDctFeatures(rows, length, positions, params_, dctStats);
+    CloneStats& stats = result_.stats;
+    stats.uniqueKeys = dctStats.uniqueRows;
+    stats.keyCollisions = positions.size() - dctStats.uniqueRows;
+    stats.probeCollisions = 0;
+    stats.rejectedByDistance = dctStats.rejectedByDistance;
+    stats.candidatePairs = result_.candidatePairs.size();
+}
+
+// Replaces candidatePairs with the keypoint engine's pairs
+void CloneDetector::matchKeypointPairs() {
+    KeypointMatchStats keypointStats;
+    result_.candidatePairs = matchKeypoints(keypoints_, descriptors_, params_, keypointStats);
+    // Keypoints count as keys, g2NN matches as repeated keys
+    CloneStats& stats = result_.stats;
+    stats.uniqueKeys = keypoints_.size();
+    stats.keyCollisions = keypointStats.matches;
+    stats.probeCollisions = 0;
+    stats.rejectedByDistance = keypointStats.rejectedByDistance;
+    stats.candidatePairs = result_.candidatePairs.size();
+}
+
+// Replaces candidatePairs with those of the radix sort matcher
+void CloneDetector::matchSorted() {
+    SortedMatchStats sortStats;
+    result_.candidatePairs = matchSortedKeys(bands_, params_, sortStats);
+    size_t records = 0;
+    for (const auto& band : bands_)
+        records += band.records.size();
+    CloneStats& stats = result_.stats;
+    stats.uniqueKeys = sortStats.runs;
+    stats.keyCollisions = records - sortStats.runs;
+    stats.probeCollisions = 0;
+    stats.rejectedByDistance = sortStats.rejectedByDistance;
+    stats.candidatePairs = result_.candidatePairs.size();
+}
+
+// Appends the bands' candidate pairs and counters to result_
+void CloneDetector::matchBands() {
+    int bandCount = (int)bands_.size();
+    bool matchAll = params_.matchMode == MATCH_ALL;
+    if (matchAll)
+        occurrences_.build(bands_, max(1, params_.maxOccurrences));
+    parallel_for_(Range(0, bandCount), [&](const Range& r) {
+        for (int b = r.start; b < r.end; b++) {
+            ScanBand& band = bands_[b];
+            band.pairs.clear();
+            band.rejected = 0;
+            band.painted.assign(band.records.size(), 1);
+            for (size_t i = 0; i < band.records.size(); i++) {
+                const BlockRecord& rec = band.records[i];
+                Point orig;
+                blockMap_.find(rec.key, orig);
+                if (orig == rec.pos)
+                    continue;
+                bool tooClose = euclideanDistance(orig, rec.pos) < params_.minDistance;
+                if (tooClose)
+                    band.painted[i] = 0;
+
+                if (matchAll) {
+                    // Pairs against every earlier occurrence, oldest first
+                    if (band.ranks[i] < 0)
+                        continue;
+                    const Point* earlier = &occurrences_.positions[occurrences_.offsets[occurrences_.bucket(rec.key)]];
+                    for (int k = 0; k < band.ranks[i]; k++) {
+                        if (euclideanDistance(earlier[k], rec.pos) < params_.minDistance)
+                            band.rejected++;
+                        else
+                            band.pairs.push_back({ earlier[k], rec.pos });
+                    }
+                    continue;
+                }
+                if (tooClose) {
+                    band.rejected++;
+                    continue;
+                }
+                band.pairs.push_back({ orig, rec.pos });
+            }
+        }
+    }, parallelStripes(params_, bandCount));
+
+    CloneStats& stats = result_.stats;
+    for (const auto& band : bands_) {
+        result_.candidatePairs.insert(result_.candidatePairs.end(), band.pairs.begin(), band.pairs.end());
+        stats.keyCollisions += band.records.size(); // less the unique keys once all bands are in
+        stats.probeCollisions += band.firstSeen.probes;
+        stats.rejectedByDistance += band.rejected;
+    }
+    stats.uniqueKeys = blockMap_.count;
+    stats.candidatePairs = result_.candidatePairs.size();
+}
+
+// Runs the detector on the image shrunk by 2^pyramidLevels and marks the
+// full-size blocks that overlap a coarse cluster block, grown by one block
+// and one coarse step on every side. Block and step sizes shrink with the
+// image (blocks no smaller than 4 px), as does minDistance; the cluster
+// size is kept, since a shrunk region holds about as many shrunk steps.
+Mat CloneDetector::coarseBlockMask() {
+    int scale = 1 << params_.pyramidLevels;
+    if (coarseImage_.empty()) {
+        Size size(max(1, image_.cols / scale), max(1, image_.rows / scale));
+        resize(image_, coarseImage_, size, 0, 0, INTER_AREA);
+        coarse_.reset(new CloneDetector());
+        coarse_->setImage(coarseImage_);
+    }
+    CloneParams cp = params_;
+    cp.pyramidLevels = 0;
+    cp.blockSize = max(4, params_.blockSize / scale);
+    cp.stepSize = max(1, params_.stepSize / scale);
+    cp.minDistance = params_.minDistance / scale;
+    const CloneResult& coarse = coarse_->detect(cp);
+
+    int blockSize = params_.blockSize, stepSize = params_.stepSize;
+    int blockRows = 0, blockCols = 0;
+    if (image_.rows >= blockSize && image_.cols >= blockSize) {
+        blockRows = (image_.rows - blockSize) / stepSize + 1;
+        blockCols = (image_.cols - blockSize) / stepSize + 1;
+    }
+    Mat mask = Mat::zeros(blockRows, blockCols, CV_8U);
+    int margin = blockSize + cp.stepSize * scale;
+    int side = cp.blockSize * scale;
+    for (const auto& cluster : coarse.clusters) {
+        for (const auto& pair : cluster) {
+            for (Point p : { pair.src, pair.dst }) {
+                // Blocks [x, x + blockSize) that meet [x0, x1) start in (x0 - blockSize, x1)
+                int x0 = p.x * scale - margin, x1 = (p.x * scale) + side + margin;
+                int y0 = p.y * scale - margin, y1 = (p.y * scale) + side + margin;
+                int c0 = max(0, (x0 - blockSize + stepSize) / stepSize), c1 = min(blockCols, (x1 - 1) / stepSize + 1);
+                int r0 = max(0, (y0 - blockSize + stepSize) / stepSize), r1 = min(blockRows, (y1 - 1) / stepSize + 1);
+                if (c0 < c1 && r0 < r1)
+                    mask(Rect(c0, r0, c1 - c0, r1 - r0)).setTo(1);
+            }
+        }
+    }
+    return mask;
+}
+
+const CloneResult& CloneDetector::detect(const CloneParams& params) {
+    CloneParams p = params;
+    p.blockSize = max(1, p.blockSize);
+    p.stepSize = max(1, p.stepSize);
+    p.pyramidLevels = min(max(0, p.pyramidLevels), 8);
+    if (p.matchEngine == ENGINE_KEYPOINT)
+        p.pyramidLevels = 0;
+
+    // Each parameter invalidates the first stage that reads it
+    if (p.blockSize != params_.blockSize || p.stepSize != params_.stepSize
+        || p.detailThreshold != params_.detailThreshold || p.detailEngine != params_.detailEngine
+        || p.keyEngine != params_.keyEngine || p.matchEngine != params_.matchEngine
+        || p.keyMatcher != params_.keyMatcher
+        || p.dctCoefficients != params_.dctCoefficients || p.dctQuantStep != params_.dctQuantStep
+        || p.keypointType != params_.keypointType || p.maxKeypoints != params_.maxKeypoints)
+        dirtyStage_ = min(dirtyStage_, (int)STAGE_SCAN);
+    if (p.minDistance != params_.minDistance || p.matchMode != params_.matchMode
+        || p.maxOccurrences != params_.maxOccurrences || p.dctWindow != params_.dctWindow
+        || p.dctTolerance != params_.dctTolerance || p.g2nnRatio != params_.g2nnRatio)
+        dirtyStage_ = min(dirtyStage_, (int)STAGE_MATCH);
+    if (p.minClusterSize != params_.minClusterSize || p.directionTolerance != params_.directionTolerance
+        || p.mergeReversed != params_.mergeReversed || p.clusterRadius != params_.clusterRadius)
+        dirtyStage_ = min(dirtyStage_, (int)STAGE_CLUSTER);
+    if (p.pyramidLevels != params_.pyramidLevels)
+        coarseImage_.release();
+    params_ = p;
+
+    CloneStats& stats = result_.stats;
+    int64 t = getTickCount();
+    bool anyBlocks = true;
+    stats.pyramidMs = 0;
+    if (params_.pyramidLevels > 0) {
+        // The coarse detector caches its own stages; rescan only if the mask moved
+        Mat mask = coarseBlockMask();
+        bool same = blockMask_.size() == mask.size()
+            && (mask.empty() || norm(blockMask_, mask, NORM_INF) == 0);
+        if (!same)
+            dirtyStage_ = min(dirtyStage_, (int)STAGE_SCAN);
+        blockMask_ = mask;
+        anyBlocks = countNonZero(mask) > 0;
+        stats.pyramidMs = elapsedMs(t);
+    } else if (!blockMask_.empty()) {
+        blockMask_.release();
+        dirtyStage_ = min(dirtyStage_, (int)STAGE_SCAN);
+    }
+
+    t = getTickCount();
+    bool keypoints = params_.matchEngine == ENGINE_KEYPOINT;
+    if (params_.detailEngine == DETAIL_INTEGRAL && !detailReady_ && anyBlocks && !keypoints) {
+        detailMap_.compute(image_);
+        detailReady_ = true;
+        stats.detailMs = elapsedMs(t);
+    }
+    if (params_.detailEngine == DETAIL_PER_BLOCK || keypoints)
+        stats.detailMs = 0; // measured as part of the scan
+    bool useSampleMap = params_.matchEngine == ENGINE_HASH && params_.keyEngine == KEY_SAMPLE_MAP
+        && SampleMap::supports(params_.blockSize);
+    if (useSampleMap && anyBlocks && sampleMap_.window != SampleMap::windowFor(params_.blockSize)) {
+        t = getTickCount();
+        sampleMap_.compute(image_, SampleMap::windowFor(params_.blockSize), params_.threads);
+        stats.keyMapMs = elapsedMs(t);
+    }
+    if (!useSampleMap)
+        stats.keyMapMs = 0;
+    if (dirtyStage_ <= STAGE_SCAN && keypoints) {
+        t = getTickCount();
+        bands_.clear();
+        detectKeypoints(image_, params_, keypoints_, descriptors_);
+        stats.blocksVisited = keypoints_.size();
+        stats.blocksFiltered = 0;
+        stats.scanMs = elapsedMs(t);
+    } else if (dirtyStage_ <= STAGE_SCAN) {
+        t = getTickCount();
+        int blockRows = 0;
+        if (image_.rows >= params_.blockSize && image_.cols >= params_.blockSize)
+            blockRows = (image_.rows - params_.blockSize) / params_.stepSize + 1;
+        stats.blocksVisited = stats.blocksFiltered = 0;
+        scanBlocks(0, blockRows);
+        stats.scanMs = elapsedMs(t);
+    }
+    if (dirtyStage_ <= STAGE_MATCH && keypoints) {
+        t = getTickCount();
+        matchKeypointPairs();
+        stats.matchMs = elapsedMs(t);
+    } else if (dirtyStage_ <= STAGE_MATCH && params_.matchEngine == ENGINE_DCT) {
+        t = getTickCount();
+        matchDct();
+        stats.matchMs = elapsedMs(t);
+    } else if (dirtyStage_ <= STAGE_MATCH && params_.keyMatcher == MATCHER_RADIX_SORT) {
+        t = getTickCount();
+        matchSorted();
+        stats.matchMs = elapsedMs(t);
+    } else if (dirtyStage_ <= STAGE_MATCH) {
+        t = getTickCount();
+        blockMap_.clear();
+        mergeBands();
+        result_.candidatePairs.clear();
+        stats.keyCollisions = stats.probeCollisions = stats.rejectedByDistance = 0;
+        matchBands();
+        stats.keyCollisions -= blockMap_.count;
+        stats.probeCollisions += blockMap_.probes;
+        stats.matchMs = elapsedMs(t);
+    }
+    if (dirtyStage_ <= STAGE_CLUSTER) {
+        t = getTickCount();
+        if (keypoints)
+            result_.clusters = clusterKeypointPairs(result_.candidatePairs, params_.minClusterSize,
+                                                    params_.clusterRadius);
+        else
+            result_.clusters = clusterClones(result_.candidatePairs, params_.minClusterSize,
+                                             params_.directionTolerance, params_.mergeReversed);
+        stats.clustersKept = result_.clusters.size();
+        stats.clusterMs = elapsedMs(t);
+    }
+    result_.blockSize = params_.blockSize;
+    dirtyStage_ = STAGE_DONE;
+    return result_;
+}
+
+// Strips are scanned and merged in image order, so the first occurrence of
+// every key and the order of candidatePairs match the in-memory run. A strip
+// keeps one row of context above and below its blocks, which makes the strip
+// Laplacian equal to the whole-image one on every row a block reads.
+const CloneResult& CloneDetector::detectStream(StripReader& reader, const CloneParams& params,
+                                               size_t memoryBudget) {
+    params_ = params;
+    params_.matchMode = MATCH_FIRST;
+    params_.matchEngine = ENGINE_HASH;
+    params_.keyMatcher = MATCHER_HASH_TABLE;
+    params_.pyramidLevels = 0;
+    blockMask_.release();
+    params_.blockSize = max(1, params_.blockSize);
+    params_.stepSize = max(1, params_.stepSize);
+    int blockSize = params_.blockSize;
+    int stepSize = params_.stepSize;
+    Size size = reader.size();
+    int blockRows = 0;
+    if (size.height >= blockSize && size.width >= blockSize)
+        blockRows = (size.height - blockSize) / stepSize + 1;
+
+    // Per pixel row: BGR strip, gray, Laplacian and its two integrals, plus
+    // the block records and band tables of the blocks starting on that row
+    size_t blockCols = size.width / stepSize + 1;
+    size_t rowBytes = (size_t)size.width * (3 + 1 + 4 + 2 * sizeof(double))
+                    + blockCols * (sizeof(BlockRecord) + 2 * sizeof(BlockTable::Slot) + 1) / stepSize;
+    int minRows = blockSize + stepSize + 2;
+    int stripRows = (int)min((size_t)max(size.height, minRows), max((size_t)minRows, memoryBudget / max(rowBytes, (size_t)1)));
+
+    result_ = CloneResult();
+    result_.blockSize = blockSize;
+    CloneStats& stats = result_.stats;
+    blockMap_.clear();
+    int64 scanStart = getTickCount();
+
+    Mat buffer(stripRows, size.width, CV_8UC3);
+    int bufferTop = 0, bufferRows = 0; // image row of buffer row 0, rows held
+    int nextRow = 0;                   // first block row not scanned yet
+    while (nextRow < blockRows) {
+        // Keep the rows the remaining blocks and their context still need
+        int keepFrom = max(0, nextRow * stepSize - 1);
+        int drop = keepFrom - bufferTop;
+        if (drop > 0) {
+            int kept = max(0, bufferRows - drop);
+            for (int r = 0; r < kept; r++)
+                buffer.row(drop + r).copyTo(buffer.row(r));
+            // With steps longer than the block, some rows are never read
+            for (int skip = drop - bufferRows; skip > 0;) {
+                Mat scratch = buffer.rowRange(0, min(skip, stripRows));
+                int n = reader.read(scratch);
+                if (n == 0) break;
+                skip -= n;
+            }
+            bufferTop = keepFrom;
+            bufferRows = kept;
+        }
+        Mat room = buffer.rowRange(bufferRows, stripRows);
+        int got = reader.read(room);
+        bufferRows += got;
+        int readEnd = bufferTop + bufferRows;
+        bool atBottom = (readEnd == size.height);
+        if (got == 0 && !atBottom)
+            break; // truncated input; keep what was found so far
+
+        int usableEnd = atBottom ? readEnd : readEnd - 1;
+        if (usableEnd < blockSize)
+            break; // not even the first block row is complete
+        int lastRow = min(blockRows, (usableEnd - blockSize) / stepSize + 1);
+        if (lastRow <= nextRow)
+            break;
+
+        image_ = buffer.rowRange(0, bufferRows);
+        originY_ = bufferTop;
+        if (params_.detailEngine == DETAIL_INTEGRAL) {
+            int64 t = getTickCount();
+            detailMap_.compute(image_);
+            stats.detailMs += elapsedMs(t);
+        }
+        if (params_.keyEngine == KEY_SAMPLE_MAP && SampleMap::supports(blockSize)) {
+            int64 t = getTickCount();
+            sampleMap_.compute(image_, SampleMap::windowFor(blockSize), params.threads);
+            stats.keyMapMs += elapsedMs(t);
+        }
+        scanBlocks(nextRow, lastRow);
+        mergeBands();
+        matchBands();
+        nextRow = lastRow;
+    }
+    stats.keyCollisions -= blockMap_.count;
+    stats.probeCollisions += blockMap_.probes;
+    stats.scanMs = elapsedMs(scanStart) - stats.detailMs - stats.keyMapMs; // includes matching
+
+    int64 t = getTickCount();
+    result_.clusters = clusterClones(result_.candidatePairs, params_.minClusterSize,
+                                     params_.directionTolerance, params_.mergeReversed);
+    stats.clustersKept = result_.clusters.size();
+    stats.clusterMs = elapsedMs(t);
+
+    image_ = Mat();
+    originY_ = 0;
+    sampleMap_ = SampleMap();
+    bands_.clear();
+    dirtyStage_ = STAGE_DETAIL;
+    detailReady_ = false;
+    return result_;
+}
+
+// Draws the band's own pixel rows. Blocks from earlier bands that reach into
+// them are drawn first, so later blocks overwrite earlier ones exactly as in
+// a single raster pass.
+void CloneDetector::paintBand(Mat& out, size_t b) const {
+    int blockSize = params_.blockSize;
+    int stepSize = params_.stepSize;
+    int rowBegin = bands_[b].firstRow * stepSize;
+    int rowEnd = (b + 1 < bands_.size()) ? bands_[b + 1].firstRow * stepSize : out.rows;
+
+    for (size_t p = 0; p <= b; p++) {
+        if ((bands_[p].lastRow - 1) * stepSize + blockSize <= rowBegin)
+            continue;
+        for (size_t i = 0; i < bands_[p].records.size(); i++) {
+            if (!bands_[p].painted[i]) continue;
+            const BlockRecord& rec = bands_[p].records[i];
+            int top = max(rec.pos.y, rowBegin);
+            int bottom = min(rec.pos.y + blockSize, rowEnd);
+            if (top >= bottom) continue;
+
+            Mat compressed(4, 4, CV_8U);
+            memcpy(compressed.data, rec.cells, sizeof(rec.cells));
+            Mat avgBlock;
+            resize(compressed, avgBlock, Size(blockSize, blockSize), 0, 0, INTER_NEAREST);
+            cvtColor(avgBlock, avgBlock, COLOR_GRAY2BGR);
+            avgBlock.rowRange(top - rec.pos.y, bottom - rec.pos.y)
+                .copyTo(out(Rect(rec.pos.x, top, blockSize, bottom - top)));
+        }
+    }
+}
+
+Mat CloneDetector::renderQuantized() const {
+    Mat out = image_.clone();
+    if (dirtyStage_ != STAGE_DONE)
+        return out;
+    parallel_for_(Range(0, (int)bands_.size()), [&](const Range& r) {
+        for (int b = r.start; b < r.end; b++)
+            paintBand(out, b);
+    }, (double)bands_.size());
+    return out;
+}
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+class StripReader;
+struct DctBasis;
+
+struct ClonePair {
+    cv::Point src;
+    cv::Point dst;
+    cv::Point displacement() const {
+        return cv::Point(dst.x - src.x, dst.y - src.y);
+    }
+};
+
+// Detail engines: the original per-block Laplacian, or lookups into
+// summed-area tables of a Laplacian computed once over the whole image.
+enum DetailEngine { DETAIL_PER_BLOCK = 0, DETAIL_INTEGRAL = 1 };
+
+// Key engines: blockToKey() on every block, or reads from a sample map of the
+// whole image. Both give the same keys; block sizes that are not a multiple
+// of 4 always use blockToKey().
+enum KeyEngine { KEY_PER_BLOCK = 0, KEY_SAMPLE_MAP = 1 };
+
+// Match modes: pair each block with the first block that had its key, or
+// with every earlier block that had it (up to maxOccurrences per key)
+enum MatchMode { MATCH_FIRST = 0, MATCH_ALL = 1 };
+
+// Matching engines: exact packed 4x4 keys, quantized block-DCT features
+// compared within a window of their lexicographic order (see dct_matcher.h),
+// or keypoints matched by descriptor, which finds rotated and scaled copies
+// (see keypoint_matcher.h)
+enum MatchEngine { ENGINE_HASH = 0, ENGINE_DCT = 1, ENGINE_KEYPOINT = 2 };
+
+enum KeypointType { KEYPOINT_ORB = 0, KEYPOINT_SIFT = 1 };
+
+// How ENGINE_HASH finds equal keys: open-addressing tables, or a parallel
+// radix sort of all keys (see radix_matcher.h). Both give the same pairs.
+enum KeyMatcher { MATCHER_HASH_TABLE = 0, MATCHER_RADIX_SORT = 1 };
+
+struct CloneParams {
+    int blockSize = 4;             // pixels
+    int stepSize = 4;
+    double detailThreshold = 9.7;
+    int minDistance = 20;
+    int matchMode = MATCH_FIRST;
+    int maxOccurrences = 16;       // MATCH_ALL: later blocks with a key are ignored
+    int keyMatcher = MATCHER_HASH_TABLE;
+    int pyramidLevels = 0;         // >0: find clusters on a 2^n times smaller copy first
+    int minClusterSize = 3;
+    double directionTolerance = 5.0;
+    bool mergeReversed = false;    // cluster A->B and B->A copies together
+    int detailEngine = DETAIL_INTEGRAL;
+    int keyEngine = KEY_SAMPLE_MAP;
+    int bands = 0;                 // scan bands run in parallel; 0 = four per worker
+    int threads = 0;               // concurrent tasks in the detector's own loops; 0 = OpenCV's pool size
+    int matchEngine = ENGINE_HASH;
+    int dctCoefficients = 16;      // ENGINE_DCT: zigzag coefficients kept per block
+    double dctQuantStep = 4.0;     // ENGINE_DCT: DC step in gray levels, grows with frequency
+    int dctWindow = 8;             // ENGINE_DCT: sorted neighbours compared per row
+    int dctTolerance = 1;          // ENGINE_DCT: largest coefficient difference still matching
+    int keypointType = KEYPOINT_ORB;
+    int maxKeypoints = 20000;      // ENGINE_KEYPOINT: strongest keypoints kept
+    double g2nnRatio = 0.5;        // ENGINE_KEYPOINT: neighbour i matches while d_i / d_(i+1) is below this
+    double clusterRadius = 50.0;   // ENGINE_KEYPOINT: pairs whose ends are this close cluster together
+};
+
+// Workers the detector's parallel loops use: params.threads, or the size of
+// OpenCV's thread pool when it is 0
+int workerCount(const CloneParams& params);
+
+// nstripes for a parallel_for_ over n tasks. With params.threads > 0 the
+// tasks are grouped into that many stripes, so no more run at once; the pool
+// itself is left alone and other OpenCV work keeps every worker.
+double parallelStripes(const CloneParams& params, int n);
+
+// Counters gathered while detecting. Stage times are from the last run of
+// each stage, so a stage reused from cache keeps its earlier time.
+struct CloneStats {
+    size_t blocksVisited = 0;
+    size_t blocksFiltered = 0;     // below the detail threshold
+    size_t uniqueKeys = 0;
+    size_t keyCollisions = 0;      // blocks whose key was already taken
+    size_t probeCollisions = 0;    // occupied hash slots passed over on insert
+    size_t rejectedByDistance = 0; // matches closer than minDistance
+    size_t candidatePairs = 0;
+    size_t clustersKept = 0;
+    double pyramidMs = 0, detailMs = 0, keyMapMs = 0, scanMs = 0, matchMs = 0, clusterMs = 0;
+};
+
+struct CloneResult {
+    int blockSize = 0;
+    std::vector<ClonePair> candidatePairs;
+    std::vector<std::vector<ClonePair>> clusters;
+    CloneStats stats;
+};
+
+// Packs the 16 quantized values of the 4x4 thumbnail into one integer, first
+// value in the top nibble, so keys order the same way the old strings did.
+uint64_t blockToKey(const cv::Mat& block, cv::Mat& smallOut);
+
+double computeDetail(const cv::Mat& block);
+
+double euclideanDistance(cv::Point a, cv::Point b);
+
+// Greedy displacement clustering with the same result as comparing every
+// pair against every later one. Displacements are bucketed into cells one
+// tolerance wide, so each reference only visits the 3x3 cells around it.
+// With normalizeSign, pairs whose displacement is the negated reference
+// (B->A instead of A->B) join the cluster too, with src and dst swapped.
+std::vector<std::vector<ClonePair>> clusterClones(const std::vector<ClonePair>& pairs, int minClusterSize,
+                                                  double directionTolerance = 5.0, bool normalizeSign = false);
+
+// Green/magenta boxes around each clustered pair, joined by a white line
+void drawClusters(cv::Mat& image, const CloneResult& result);
+
+// 255 on every block that belongs to a cluster
+cv::Mat tamperMask(cv::Size size, const CloneResult& result);
+
+// Integrals of the grayscale Laplacian and of its square
+struct DetailMap {
+    cv::Mat lapSum, lapSqSum;
+
+    void compute(const cv::Mat& image);
+    double blockDetail(int x, int y, int blockSize) const;
+};
+
+// resize() to 4x4 reads only the centre of each cell: the rounded mean of the
+// central 2x2 pixels for even cell sizes, the central pixel for odd ones. The
+// map holds that value for every window position of the grayscale image, so
+// a block's 16 cells are 16 reads instead of a cvtColor and a resize.
+struct SampleMap {
+    cv::Mat samples;
+    int window = 0; // 1 or 2, 0 before compute()
+
+    static bool supports(int blockSize) { return blockSize >= 4 && blockSize % 4 == 0; }
+    static int windowFor(int blockSize) { return (blockSize / 4) % 2 ? 1 : 2; }
+    void compute(const cv::Mat& image, int window, int threads = 0);
+    // Same key and thumbnail as blockToKey() on the block at (x, y)
+    uint64_t blockKey(int x, int y, int blockSize, uchar cells[16]) const;
+};
+
+// Open-addressing map from packed keys to the first block seen with that key.
+// Slots are 16 bytes and probed linearly, so most lookups touch one cache line.
+struct BlockTable {
+    struct Slot {
+        uint64_t key;
+        int x, y; // x < 0 marks an empty slot
+    };
+    std::vector<Slot> slots;
+    size_t mask = 0;
+    size_t count = 0;
+    size_t probes = 0; // occupied slots holding other keys passed by findOrInsert()
+
+    static uint64_t mix(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    }
+
+    // Sizes the table for n keys at no more than 50% load
+    void reserve(size_t n);
+    // Empties the table but keeps its storage
+    void clear();
+    bool find(uint64_t key, cv::Point& first) const;
+    // Returns true and the stored position if key is known, else stores pos
+    bool findOrInsert(uint64_t key, cv::Point pos, cv::Point& first);
+};
+
+// One scanned block that passed the detail threshold
+struct BlockRecord {
+    uint64_t key;
+    cv::Point pos;
+    uchar cells[16]; // 4x4 thumbnail, kept for the quantized view
+};
+
+// A horizontal band of block rows [firstRow, lastRow), scanned by one task
+struct ScanBand {
+    int firstRow = 0, lastRow = 0;
+    size_t visited = 0, rejected = 0;
+    std::vector<BlockRecord> records; // raster order
+    std::vector<uchar> painted;       // records the sequential scan would have drawn
+    std::vector<int> ranks;           // MATCH_ALL: index in the key's bucket, -1 past the cap
+    std::vector<cv::Point> dctPos;    // ENGINE_DCT: blocks in raster order, instead of records
+    std::vector<short> dctRows;       // ENGINE_DCT: one feature row per dctPos entry
+    BlockTable firstSeen;             // first occurrence of each key within the band
+    std::vector<ClonePair> pairs;
+};
+
+// Occurrences of every key in raster order, stored contiguously per key in
+// one arena (CSR layout): bucket b is positions[offsets[b]] up to
+// positions[offsets[b + 1]]. Buckets keep at most maxPerKey positions, so flat
+// regions where thousands of blocks share a key cannot blow up the pairs.
+struct OccurrenceIndex {
+    BlockTable buckets; // key -> bucket id, stored in the slot's x
+    std::vector<int> offsets;
+    std::vector<cv::Point> positions;
+
+    // Also fills each band's ranks
+    void build(std::vector<ScanBand>& bands, int maxPerKey);
+    int bucket(uint64_t key) const;
+};
+
+// Copy-move detector over one image. The pipeline runs in stages (detail map,
+// block scan, matching, clustering) whose outputs are kept between calls;
+// detect() reruns only the stages whose parameters changed and reuses the
+// buffers of the previous run. Instances share no state, so separate
+// detectors can run concurrently on different threads.
+class CloneDetector {
+public:
+    // Expects a BGR image; the image data is referenced, not copied
+    void setImage(const cv::Mat& image);
+    const cv::Mat& image() const { return image_; }
+
+    // With pyramidLevels > 0, detection first runs on a downsampled copy, and
+    // only blocks near the clusters found there are scanned at full size.
+    // Images without coarse clusters skip the full-size scan entirely.
+    // ENGINE_KEYPOINT scans no blocks, so it ignores pyramidLevels, stepSize
+    // and the detail threshold; blockSize only sets the drawn box size.
+    // params.threads caps the scan, the sample map and matching; OpenCV's own
+    // functions (colour conversion, Laplacian, keypoints) use its whole pool.
+    const CloneResult& detect(const CloneParams& params);
+    const CloneResult& result() const { return result_; }
+
+    // Same result as setImage() and detect() on the whole image, but decodes
+    // it in strips sized to keep the strip buffers within memoryBudget bytes.
+    // Each strip carries the last blockSize rows of the previous one. The key
+    // table and candidate pairs are not bounded; they grow with the number of
+    // distinct keys and matches. Leaves no image, so renderQuantized() and
+    // later detect() calls need a new setImage(). Always uses MATCH_FIRST, as
+    // earlier strips are gone by the time later occurrences are found, and
+    // ENGINE_HASH, as DCT features of every block would exceed the budget.
+    // Keys are matched in the hash table whatever keyMatcher says, and
+    // pyramidLevels is ignored; params() returns the settings actually used.
+    const CloneResult& detectStream(StripReader& reader, const CloneParams& params, size_t memoryBudget);
+    // Parameters of the last detect() or detectStream() call, after the
+    // overrides above
+    const CloneParams& params() const { return params_; }
+
+    // Builds the detail and sample maps that params would use, without
+    // scanning. Another detector on the same image can take them with
+    // shareMaps(), so a parameter sweep computes them once.
+    void prepareMaps(const CloneParams& params);
+    // Takes source's maps if it holds the same image; the Mats are shared
+    void shareMaps(const CloneDetector& source);
+
+    // Every block that produced a key or a candidate, drawn as its 4x4 thumbnail
+    cv::Mat renderQuantized() const;
+
+private:
+    enum Stage { STAGE_DETAIL = 0, STAGE_SCAN, STAGE_MATCH, STAGE_CLUSTER, STAGE_DONE };
+
+    void scanBand(ScanBand& band) const;
+    void scanBandDct(ScanBand& band, const DctBasis& basis) const;
+    void matchDct();
+    void matchKeypointPairs();
+    void matchSorted();
+    cv::Mat coarseBlockMask();
+    void paintBand(cv::Mat& out, size_t b) const;
+    void scanBlocks(int firstRow, int lastRow);
+    void mergeBands();
+    void matchBands();
+
+    cv::Mat image_;
+    int originY_ = 0; // image row of image_'s first row, nonzero only while streaming
+    CloneParams params_;
+    int dirtyStage_ = STAGE_DETAIL;
+    bool detailReady_ = false;
+    DetailMap detailMap_;
+    SampleMap sampleMap_;
+    std::vector<ScanBand> bands_;
+    BlockTable blockMap_;
+    OccurrenceIndex occurrences_;
+    cv::Mat blockMask_;                      // pyramid mode: block rows x cols, nonzero = scan
+    cv::Mat coarseImage_;
+    std::unique_ptr<CloneDetector> coarse_;
+    std::vector<cv::Point2f> keypoints_;     // ENGINE_KEYPOINT
+    cv::Mat descriptors_;
+    CloneResult result_;
+};
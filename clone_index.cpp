@@ -0,0 +1,191 @@
+#include "region_index.h"
+#include "report_json.h"
+
+#include <opencv2/imgcodecs.hpp>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+using namespace cv;
+using namespace std;
+
+// Cross-image index: adds images to a persistent block key index and finds
+// regions of query images that also occur in indexed images.
+
+void printUsage() {
+    cerr << "usage: clone_index add <dir> [options] <image>...\n"
+         << "       clone_index query <dir> [options] <image>...\n"
+         << "       clone_index compact <dir>\n"
+         << "       clone_index info <dir>\n"
+         << "  --block N           block size of a new index (default 4)\n"
+         << "  --step N            block step of a new index (default 4)\n"
+         << "  --detail X          minimal block detail of a new index (default 9.7)\n"
+         << "  --cluster-size N    query: minimal pairs per cluster (default 3)\n"
+         << "  --max-hits N        query: skip keys found in more than N indexed\n"
+         << "                      blocks (default 64)\n"
+         << "  --stats             query: add lookup counters to each record\n"
+         << "  --list FILE         read further image paths from FILE, - for stdin\n"
+         << "query writes a JSON array with one record per image to stdout. Exit\n"
+         << "status is 0 if no query image matched, 1 if any did, 2 on errors.\n";
+}
+
+void writeQueryStats(ostream& out, const IndexQueryStats& st) {
+    out << "{\"queryKeys\": " << st.queryKeys
+        << ", \"hits\": " << st.hits
+        << ", \"skippedKeys\": " << st.skippedKeys
+        << ", \"stageMs\": {\"keys\": " << st.keyMs << ", \"lookup\": " << st.lookupMs
+        << ", \"cluster\": " << st.clusterMs << "}}";
+}
+
+void writeQueryRecord(ostream& out, const string& imagePath, const vector<IndexMatch>& matches,
+                      const IndexQueryStats* stats) {
+    out << "  {\"image\": \"" << jsonEscape(imagePath) << "\",";
+    if (stats) {
+        out << " \"stats\": ";
+        writeQueryStats(out, *stats);
+        out << ",";
+    }
+    out << " \"matches\": [";
+    for (size_t m = 0; m < matches.size(); m++) {
+        out << (m ? ",\n" : "\n")
+            << "    {\"id\": " << matches[m].image
+            << ", \"path\": \"" << jsonEscape(matches[m].path) << "\""
+            << ", \"pairs\": " << matches[m].pairs << ", \"clusters\": ";
+        writeClusters(out, matches[m].clusters, "    ");
+        out << "}";
+    }
+    out << (matches.empty() ? "]}" : "\n  ]}");
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        printUsage();
+        return 2;
+    }
+    string command = argv[1];
+    string dir = argv[2];
+    if (command != "add" && command != "query" && command != "compact" && command != "info") {
+        cerr << "Unknown command " << command << endl;
+        printUsage();
+        return 2;
+    }
+
+    CloneParams params;
+    int minClusterSize = 3;
+    size_t maxHits = 64;
+    bool printStats = false;
+    vector<string> images;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--block" && hasValue) {
+            params.blockSize = atoi(argv[++i]);
+        } else if (arg == "--step" && hasValue) {
+            params.stepSize = atoi(argv[++i]);
+        } else if (arg == "--detail" && hasValue) {
+            params.detailThreshold = atof(argv[++i]);
+        } else if (arg == "--cluster-size" && hasValue) {
+            minClusterSize = atoi(argv[++i]);
+        } else if (arg == "--max-hits" && hasValue) {
+            maxHits = (size_t)max(1, atoi(argv[++i]));
+        } else if (arg == "--stats") {
+            printStats = true;
+        } else if (arg == "--list" && hasValue) {
+            string listPath = argv[++i];
+            ifstream listFile;
+            if (listPath != "-") {
+                listFile.open(listPath);
+                if (!listFile) {
+                    cerr << "Could not open list " << listPath << endl;
+                    return 2;
+                }
+            }
+            istream& in = (listPath == "-") ? cin : listFile;
+            string line;
+            while (getline(in, line)) {
+                if (!line.empty())
+                    images.push_back(line);
+            }
+        } else if (arg == "-h" || arg == "--help") {
+            printUsage();
+            return 0;
+        } else if (!arg.empty() && arg[0] == '-') {
+            cerr << "Unknown option " << arg << endl;
+            printUsage();
+            return 2;
+        } else {
+            images.push_back(arg);
+        }
+    }
+    if (params.blockSize < 1 || params.stepSize < 1) {
+        cerr << "Block and step size must be positive" << endl;
+        return 2;
+    }
+
+    RegionIndex index;
+    if (!index.open(dir, params, command == "add")) {
+        cerr << "Could not open index " << dir << endl;
+        return 2;
+    }
+
+    if (command == "info") {
+        const CloneParams& p = index.params();
+        cout << "{\"images\": " << index.imageCount()
+             << ", \"entries\": " << index.entryCount()
+             << ", \"segments\": " << index.segmentCount()
+             << ", \"blockSize\": " << p.blockSize
+             << ", \"stepSize\": " << p.stepSize
+             << ", \"detailThreshold\": " << p.detailThreshold << "}" << endl;
+        return 0;
+    }
+    if (command == "compact") {
+        if (!index.compact()) {
+            cerr << "Could not compact index " << dir << endl;
+            return 2;
+        }
+        return 0;
+    }
+    if (images.empty()) {
+        printUsage();
+        return 2;
+    }
+
+    bool anyMatches = false, anyErrors = false;
+    if (command == "add") {
+        for (const string& path : images) {
+            Mat image = imread(path, IMREAD_COLOR);
+            if (image.empty()) {
+                cerr << "Could not open image " << path << endl;
+                anyErrors = true;
+                continue;
+            }
+            index.add(path, image);
+        }
+        if (!index.flush()) {
+            cerr << "Could not write index " << dir << endl;
+            return 2;
+        }
+        return anyErrors ? 2 : 0;
+    }
+
+    cout << "[";
+    bool first = true;
+    for (const string& path : images) {
+        Mat image = imread(path, IMREAD_COLOR);
+        if (image.empty()) {
+            cerr << "Could not open image " << path << endl;
+            anyErrors = true;
+            continue;
+        }
+        IndexQueryStats stats;
+        vector<IndexMatch> matches = index.query(image, minClusterSize, maxHits, &stats);
+        cout << (first ? "\n" : ",\n");
+        writeQueryRecord(cout, path, matches, printStats ? &stats : nullptr);
+        first = false;
+        anyMatches = anyMatches || !matches.empty();
+    }
+    cout << (first ? "]" : "\n]") << endl;
+    return anyErrors ? 2 : (anyMatches ? 1 : 0);
+}
@@ -0,0 +1,259 @@
+#include "clone_detector.h"
+#include "synthetic.h"
+
+#include <opencv2/core.hpp>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+// End-to-end regression check: runs the detector on a fixed set of seeded
+// synthetic forgeries, each in several post-processed variants, and compares
+// throughput and pixel F1 with a stored baseline.
+
+void printUsage() {
+    cerr << "usage: clone_regress [options]\n"
+         << "  --images N          base images, seeds 1..N (default 6)\n"
+         << "  --size MP           image size in megapixels (default 2)\n"
+         << "  --repeat N          timed passes, the fastest counts (default 3)\n"
+         << "  --block N           block size in pixels (default 4)\n"
+         << "  --step N            block step in pixels (default 4)\n"
+         << "  --detail X          minimal block detail (default 9.7)\n"
+         << "  --baseline FILE     compare with FILE and fail on a regression\n"
+         << "  --write-baseline FILE  store this run as the new baseline\n"
+         << "  --ignore-speed      do not check images/s, e.g. on a machine other than the\n"
+         << "                      one that wrote the baseline\n"
+         << "  --speed-tolerance X allowed images/s drop as a fraction (default 0.10)\n"
+         << "  --f1-tolerance X    allowed F1 drop, overall and per variant (default 0.01)\n"
+         << "Exit status is 0 if nothing regressed, 1 if an F1 or images/s fell below\n"
+         << "the baseline by more than its tolerance, 2 on errors, and 77 if the\n"
+         << "baseline lacks a checked value (every F1 and imagesPerSec).\n";
+}
+
+double elapsedMs(int64 start) {
+    return (getTickCount() - start) * 1000.0 / getTickFrequency();
+}
+
+// Process-wide high-water mark, as in clone_bench
+double peakRssMB() {
+#ifdef _WIN32
+    return 0.0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+struct Variant {
+    string name;
+    ForgeryOptions options;
+};
+
+// The fixed variant set; names are baseline keys, so keep them stable
+vector<Variant> variants() {
+    vector<Variant> list(6);
+    list[0].name = "clean";
+    list[1].name = "jpeg90";
+    list[1].options.jpegQuality = 90;
+    list[2].name = "jpeg75";
+    list[2].options.jpegQuality = 75;
+    list[3].name = "noise2";
+    list[3].options.noiseSigma = 2.0;
+    list[4].name = "bright8";
+    list[4].options.copyBrightness = 8;
+    list[5].name = "scale105";
+    list[5].options.copyScale = 1.05;
+    return list;
+}
+
+struct PixelCounts {
+    size_t truePixels = 0, falsePixels = 0, missedPixels = 0;
+
+    double f1() const {
+        size_t denominator = 2 * truePixels + falsePixels + missedPixels;
+        return denominator ? 2.0 * truePixels / denominator : 1.0;
+    }
+};
+
+// "name value" lines; blank lines and lines starting with # are skipped
+map<string, double> readBaseline(const string& path, bool& ok) {
+    map<string, double> values;
+    ifstream in(path);
+    ok = (bool)in;
+    string line;
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string name;
+        double value;
+        if (fields >> name && name[0] != '#' && fields >> value)
+            values[name] = value;
+    }
+    return values;
+}
+
+int main(int argc, char** argv) {
+    int imageCount = 6;
+    double megapixels = 2;
+    int repeat = 3;
+    CloneParams params;
+    string baselinePath, writePath;
+    double speedTolerance = 0.10, f1Tolerance = 0.01;
+    bool checkSpeed = true;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--images" && hasValue) {
+            imageCount = max(1, atoi(argv[++i]));
+        } else if (arg == "--size" && hasValue) {
+            megapixels = max(0.01, atof(argv[++i]));
+        } else if (arg == "--repeat" && hasValue) {
+            repeat = max(1, atoi(argv[++i]));
+        } else if (arg == "--block" && hasValue) {
+            params.blockSize = atoi(argv[++i]);
+        } else if (arg == "--step" && hasValue) {
+            params.stepSize = atoi(argv[++i]);
+        } else if (arg == "--detail" && hasValue) {
+            params.detailThreshold = atof(argv[++i]);
+        } else if (arg == "--baseline" && hasValue) {
+            baselinePath = argv[++i];
+        } else if (arg == "--write-baseline" && hasValue) {
+            writePath = argv[++i];
+        } else if (arg == "--ignore-speed") {
+            checkSpeed = false;
+        } else if (arg == "--speed-tolerance" && hasValue) {
+            speedTolerance = atof(argv[++i]);
+        } else if (arg == "--f1-tolerance" && hasValue) {
+            f1Tolerance = atof(argv[++i]);
+        } else {
+            printUsage();
+            return (arg == "-h" || arg == "--help") ? 0 : 2;
+        }
+    }
+    if (params.blockSize < 1 || params.stepSize < 1) {
+        cerr << "Block and step size must be positive" << endl;
+        return 2;
+    }
+
+    // Everything is generated before timing starts
+    int width = (int)round(sqrt(megapixels * 1e6 * 4.0 / 3.0));
+    int height = (int)round(megapixels * 1e6 / width);
+    vector<Variant> list = variants();
+    vector<SyntheticForgery> cases;
+    vector<int> caseVariant;
+    for (int seed = 1; seed <= imageCount; seed++) {
+        for (size_t v = 0; v < list.size(); v++) {
+            cases.push_back(makeSyntheticForgery(Size(width, height), 3, seed, list[v].options));
+            caseVariant.push_back((int)v);
+        }
+    }
+
+    double bestMs = 0;
+    vector<PixelCounts> counts(list.size());
+    for (int pass = 0; pass < repeat; pass++) {
+        double passMs = 0;
+        for (size_t c = 0; c < cases.size(); c++) {
+            CloneDetector detector;
+            detector.setImage(cases[c].image);
+            int64 t = getTickCount();
+            const CloneResult& result = detector.detect(params);
+            passMs += elapsedMs(t);
+            if (pass > 0)
+                continue;
+            Mat found = tamperMask(cases[c].image.size(), result), both;
+            bitwise_and(found, cases[c].mask, both);
+            size_t truePixels = countNonZero(both);
+            PixelCounts& pc = counts[caseVariant[c]];
+            pc.truePixels += truePixels;
+            pc.falsePixels += countNonZero(found) - truePixels;
+            pc.missedPixels += countNonZero(cases[c].mask) - truePixels;
+        }
+        bestMs = (pass == 0) ? passMs : min(bestMs, passMs);
+    }
+
+    map<string, double> current;
+    PixelCounts all;
+    for (size_t v = 0; v < list.size(); v++) {
+        current["f1." + list[v].name] = counts[v].f1();
+        all.truePixels += counts[v].truePixels;
+        all.falsePixels += counts[v].falsePixels;
+        all.missedPixels += counts[v].missedPixels;
+    }
+    current["f1"] = all.f1();
+    current["imagesPerSec"] = bestMs > 0 ? cases.size() * 1000.0 / bestMs : 0.0;
+    current["peakRssMB"] = peakRssMB();
+
+    bool haveBaseline = false;
+    map<string, double> baseline;
+    if (!baselinePath.empty()) {
+        baseline = readBaseline(baselinePath, haveBaseline);
+        if (!haveBaseline) {
+            cerr << "Could not open baseline " << baselinePath << endl;
+            return 2;
+        }
+    }
+
+    // A partial baseline would pass unchecked values silently
+    vector<string> missing;
+    for (const auto& entry : current) {
+        bool checked = entry.first.compare(0, 2, "f1") == 0 || (checkSpeed && entry.first == "imagesPerSec");
+        if (haveBaseline && checked && !baseline.count(entry.first))
+            missing.push_back(entry.first);
+    }
+
+    // Higher is better for everything but memory, which is only reported
+    bool regressed = false;
+    cout << format("%zu images of %dx%d, block %d step %d, best of %d passes\n", cases.size(), width, height,
+                   params.blockSize, params.stepSize, repeat);
+    for (const auto& entry : current) {
+        const string& name = entry.first;
+        cout << format("%-16s %10.4f", name.c_str(), entry.second);
+        auto base = baseline.find(name);
+        if (base != baseline.end()) {
+            bool worse = false;
+            if (name == "imagesPerSec")
+                worse = checkSpeed && entry.second < base->second * (1.0 - speedTolerance);
+            else if (name.compare(0, 2, "f1") == 0)
+                worse = entry.second < base->second - f1Tolerance;
+            cout << format("  baseline %10.4f%s", base->second, worse ? "  REGRESSED" : "");
+            regressed = regressed || worse;
+        }
+        cout << "\n";
+    }
+
+    if (!writePath.empty()) {
+        ofstream out(writePath);
+        out << "# clone_regress --images " << imageCount << " --size " << megapixels << " --repeat " << repeat
+            << " --block " << params.blockSize << " --step " << params.stepSize
+            << " --detail " << params.detailThreshold << "\n";
+        for (const auto& entry : current)
+            out << entry.first << " " << format("%.6f", entry.second) << "\n";
+        if (!out) {
+            cerr << "Could not write baseline " << writePath << endl;
+            return 2;
+        }
+    }
+    if (!missing.empty()) {
+        cerr << "Baseline " << baselinePath << " has no value for";
+        for (const string& name : missing)
+            cerr << " " << name;
+        cerr << "; record it with --write-baseline on the reference machine" << endl;
+        return regressed ? 1 : 77;
+    }
+    return regressed ? 1 : 0;
+}
@@ -0,0 +1,302 @@
+#include "clone_detector.h"
+#include "synthetic.h"
+
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdlib>
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+// Parameter sweep against ground truth. For every image the detail map and
+// the sample maps are built once; each (block, step, detail) combination
+// then scans in its own task, and the minimal distances and cluster sizes
+// under it only rerun matching and clustering on that task's detector.
+
+void printUsage() {
+    cerr << "usage: clone_sweep [options] [<image> <mask>]...\n"
+         << "  --blocks LIST        block sizes in pixels (default 4,8,16)\n"
+         << "  --steps LIST         step sizes in pixels (default 2,4)\n"
+         << "  --details LIST       detail thresholds (default 9.7)\n"
+         << "  --min-distances LIST minimal source/copy distances (default 20)\n"
+         << "  --cluster-sizes LIST minimal pairs per cluster (default 3)\n"
+         << "  --list FILE          read further <image>\\t<mask> lines from FILE, - for stdin\n"
+         << "  --synthetic N        add N generated forgeries with their masks (default 0)\n"
+         << "  --size MP            size of the generated forgeries in megapixels (default 1)\n"
+         << "  --seed N             first generator seed (default 1)\n"
+         << "  --json FILE          also write the table as JSON\n"
+         << "Masks are nonzero on every tampered pixel. Writes one row per setting\n"
+         << "to stdout: pixel precision, recall and F1 over all images, and the\n"
+         << "detection time that setting would take on its own.\n";
+}
+
+vector<double> parseList(const string& text) {
+    vector<double> values;
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ','))
+        values.push_back(atof(item.c_str()));
+    return values;
+}
+
+double elapsedMs(int64 start) {
+    return (getTickCount() - start) * 1000.0 / getTickFrequency();
+}
+
+struct SweepInput {
+    string name;
+    Mat image, truth;
+};
+
+struct SweepRow {
+    CloneParams params;
+    size_t truePixels = 0, falsePixels = 0, missedPixels = 0;
+    size_t clusters = 0;
+    double ms = 0; // summed over images
+
+    double precision() const {
+        size_t found = truePixels + falsePixels;
+        return found ? (double)truePixels / found : 1.0;
+    }
+    double recall() const {
+        size_t tampered = truePixels + missedPixels;
+        return tampered ? (double)truePixels / tampered : 1.0;
+    }
+    double f1() const {
+        double p = precision(), r = recall();
+        return p + r > 0 ? 2 * p * r / (p + r) : 0.0;
+    }
+};
+
+void writeJson(ostream& out, const vector<SweepRow>& rows, size_t images) {
+    out << "{\n"
+        << "  \"images\": " << images << ",\n"
+        << "  \"settings\": [";
+    for (size_t i = 0; i < rows.size(); i++) {
+        const SweepRow& r = rows[i];
+        out << (i ? ",\n" : "\n")
+            << "    {\"blockSize\": " << r.params.blockSize << ", \"stepSize\": " << r.params.stepSize
+            << ", \"detailThreshold\": " << r.params.detailThreshold
+            << ", \"minDistance\": " << r.params.minDistance
+            << ", \"minClusterSize\": " << r.params.minClusterSize
+            << ", \"precision\": " << r.precision() << ", \"recall\": " << r.recall()
+            << ", \"f1\": " << r.f1() << ", \"clusters\": " << r.clusters << ", \"ms\": " << r.ms << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char** argv) {
+    vector<double> blocks = { 4, 8, 16 };
+    vector<double> steps = { 2, 4 };
+    vector<double> details = { 9.7 };
+    vector<double> minDistances = { 20 };
+    vector<double> clusterSizes = { 3 };
+    vector<pair<string, string>> files;
+    int synthetic = 0;
+    double syntheticMP = 1;
+    uint64_t seed = 1;
+    string jsonPath;
+
+    vector<string> positional;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--blocks" && hasValue) {
+            blocks = parseList(argv[++i]);
+        } else if (arg == "--steps" && hasValue) {
+            steps = parseList(argv[++i]);
+        } else if (arg == "--details" && hasValue) {
+            details = parseList(argv[++i]);
+        } else if (arg == "--min-distances" && hasValue) {
+            minDistances = parseList(argv[++i]);
+        } else if (arg == "--cluster-sizes" && hasValue) {
+            clusterSizes = parseList(argv[++i]);
+        } else if (arg == "--synthetic" && hasValue) {
+            synthetic = max(0, atoi(argv[++i]));
+        } else if (arg == "--size" && hasValue) {
+            syntheticMP = max(0.01, atof(argv[++i]));
+        } else if (arg == "--seed" && hasValue) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--json" && hasValue) {
+            jsonPath = argv[++i];
+        } else if (arg == "--list" && hasValue) {
+            string listPath = argv[++i];
+            ifstream listFile;
+            if (listPath != "-") {
+                listFile.open(listPath);
+                if (!listFile) {
+                    cerr << "Could not open list " << listPath << endl;
+                    return 2;
+                }
+            }
+            istream& in = (listPath == "-") ? cin : listFile;
+            string line;
+            while (getline(in, line)) {
+                size_t tab = line.find('\t');
+                if (tab == string::npos) {
+                    if (!line.empty())
+                        cerr << "Ignoring list line without a mask: " << line << endl;
+                    continue;
+                }
+                files.push_back({ line.substr(0, tab), line.substr(tab + 1) });
+            }
+        } else if (arg == "-h" || arg == "--help") {
+            printUsage();
+            return 0;
+        } else if (!arg.empty() && arg[0] == '-') {
+            cerr << "Unknown option " << arg << endl;
+            printUsage();
+            return 2;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() % 2) {
+        cerr << "Every image needs a mask" << endl;
+        return 2;
+    }
+    for (size_t i = 0; i < positional.size(); i += 2)
+        files.push_back({ positional[i], positional[i + 1] });
+    if (files.empty() && synthetic == 0) {
+        printUsage();
+        return 2;
+    }
+    for (double v : blocks) {
+        if (v < 1) {
+            cerr << "Block sizes must be positive" << endl;
+            return 2;
+        }
+    }
+    for (double v : steps) {
+        if (v < 1) {
+            cerr << "Step sizes must be positive" << endl;
+            return 2;
+        }
+    }
+
+    vector<SweepInput> inputs;
+    for (const auto& file : files) {
+        SweepInput input;
+        input.name = file.first;
+        input.image = imread(file.first, IMREAD_COLOR);
+        Mat mask = imread(file.second, IMREAD_GRAYSCALE);
+        if (input.image.empty() || mask.empty() || mask.size() != input.image.size()) {
+            cerr << "Could not open " << file.first << " with a mask of its size from " << file.second << endl;
+            return 2;
+        }
+        threshold(mask, input.truth, 0, 255, THRESH_BINARY);
+        inputs.push_back(input);
+    }
+    // 4:3 images, as in clone_bench
+    int width = (int)round(sqrt(syntheticMP * 1e6 * 4.0 / 3.0));
+    int height = (int)round(syntheticMP * 1e6 / width);
+    for (int i = 0; i < synthetic; i++) {
+        SyntheticForgery forgery = makeSyntheticForgery(Size(width, height), 3, seed + i);
+        inputs.push_back({ format("synthetic-%llu", (unsigned long long)(seed + i)), forgery.image, forgery.mask });
+    }
+
+    // Rows in grid order; the scan groups are the outer three loops
+    size_t inner = minDistances.size() * clusterSizes.size();
+    size_t groups = blocks.size() * steps.size() * details.size();
+    vector<SweepRow> rows(groups * inner);
+    for (size_t g = 0; g < groups; g++) {
+        for (size_t m = 0; m < inner; m++) {
+            CloneParams& p = rows[g * inner + m].params;
+            p.blockSize = (int)blocks[g / (steps.size() * details.size())];
+            p.stepSize = (int)steps[g / details.size() % steps.size()];
+            p.detailThreshold = details[g % details.size()];
+            p.minDistance = (int)minDistances[m / clusterSizes.size()];
+            p.minClusterSize = (int)clusterSizes[m % clusterSizes.size()];
+            p.bands = 1; // the groups run in parallel instead
+        }
+    }
+
+    int64 start = getTickCount();
+    for (const SweepInput& input : inputs) {
+        // One map holder per sample window (0 = block sizes without one); the
+        // detail map is computed once and shared between them
+        vector<unique_ptr<CloneDetector>> maps(3);
+        vector<double> mapMs(3, 0);
+        double detailMs = 0;
+        bool detailReady = false;
+        for (double block : blocks) {
+            CloneParams p;
+            p.blockSize = (int)block;
+            int w = SampleMap::supports(p.blockSize) ? SampleMap::windowFor(p.blockSize) : 0;
+            if (maps[w])
+                continue;
+            maps[w].reset(new CloneDetector());
+            maps[w]->setImage(input.image);
+            int64 t = getTickCount();
+            for (const auto& other : maps) {
+                if (other && other != maps[w])
+                    maps[w]->shareMaps(*other);
+            }
+            if (!detailReady) {
+                CloneParams detailOnly = p;
+                detailOnly.keyEngine = KEY_PER_BLOCK;
+                maps[w]->prepareMaps(detailOnly);
+                detailMs = elapsedMs(t);
+                detailReady = true;
+                t = getTickCount();
+            }
+            maps[w]->prepareMaps(p);
+            mapMs[w] = elapsedMs(t);
+        }
+
+        int truthPixels = countNonZero(input.truth);
+        parallel_for_(Range(0, (int)groups), [&](const Range& range) {
+            for (int g = range.start; g < range.end; g++) {
+                int blockSize = rows[g * inner].params.blockSize;
+                int w = SampleMap::supports(blockSize) ? SampleMap::windowFor(blockSize) : 0;
+                CloneDetector detector;
+                detector.setImage(input.image);
+                detector.shareMaps(*maps[w]);
+                for (size_t m = 0; m < inner; m++) {
+                    SweepRow& row = rows[g * inner + m];
+                    const CloneResult& result = detector.detect(row.params);
+                    Mat found = tamperMask(input.image.size(), result), both;
+                    bitwise_and(found, input.truth, both);
+                    int foundPixels = countNonZero(found);
+                    int truePixels = countNonZero(both);
+                    row.truePixels += truePixels;
+                    row.falsePixels += foundPixels - truePixels;
+                    row.missedPixels += truthPixels - truePixels;
+                    row.clusters += result.clusters.size();
+                    // Stage times from each stage's last run: what this setting costs alone
+                    row.ms += detailMs + mapMs[w] + result.stats.scanMs + result.stats.matchMs
+                        + result.stats.clusterMs;
+                }
+            }
+        });
+    }
+    double wallMs = elapsedMs(start);
+
+    cout << "block\tstep\tdetail\tminDist\tcluster\tprecision\trecall\tf1\tclusters\tms\n";
+    double separateMs = 0;
+    for (const SweepRow& r : rows) {
+        cout << format("%d\t%d\t%.2f\t%d\t%d\t%.4f\t%.4f\t%.4f\t%zu\t%.1f\n", r.params.blockSize,
+                       r.params.stepSize, r.params.detailThreshold, r.params.minDistance,
+                       r.params.minClusterSize, r.precision(), r.recall(), r.f1(), r.clusters, r.ms);
+        separateMs += r.ms;
+    }
+    cerr << format("%zu settings on %zu images in %.1f ms; %.1f ms as separate single-threaded runs\n",
+                   rows.size(), inputs.size(), wallMs, separateMs);
+
+    if (!jsonPath.empty()) {
+        ofstream json(jsonPath);
+        writeJson(json, rows, inputs.size());
+        if (!json) {
+            cerr << "Could not write " << jsonPath << endl;
+            return 2;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include "dct_matcher.h"
+
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace cv;
+using namespace std;
+
+void DctBasis::init(int size, int coefficients, double quantStep) {
+    blockSize = size;
+    freqs.clear();
+    kernels.clear();
+    steps.clear();
+
+    // Zigzag over the anti-diagonals u + v = d, alternating direction
+    int count = min(coefficients, size * size);
+    for (int d = 0; (int)freqs.size() < count; d++) {
+        for (int k = 0; k <= d && (int)freqs.size() < count; k++) {
+            int u = (d % 2) ? k : d - k;
+            int v = d - u;
+            if (u < size && v < size)
+                freqs.push_back(Point(u, v));
+        }
+    }
+
+    for (int f = 0; f < size; f++) {
+        Mat kernel(size, 1, CV_32F);
+        double alpha = sqrt((f == 0 ? 1.0 : 2.0) / size);
+        for (int i = 0; i < size; i++)
+            kernel.at<float>(i) = (float)(alpha * cos((2 * i + 1) * f * CV_PI / (2 * size)));
+        kernels.push_back(kernel);
+    }
+
+    // Coefficients are divided by the block size first, which puts the DC
+    // term on the scale of the mean gray level
+    for (const Point& f : freqs)
+        steps.push_back((float)(quantStep * size * (1 + f.x + f.y)));
+}
+
+void extractDctFeatures(const Mat& gray, const DctBasis& basis,
+                        const vector<Point>& positions, vector<short>& out) {
+    int length = basis.length();
+    size_t base = out.size();
+    out.resize(base + positions.size() * length);
+    if (positions.empty())
+        return;
+
+    // Separable: one horizontal pass per horizontal frequency, then one
+    // vertical pass per coefficient. Anchor (0, 0) puts the coefficient of the
+    // block at (x, y) at (x, y) of the output.
+    Mat ones = Mat::ones(1, 1, CV_32F);
+    vector<Mat> rowPass(basis.blockSize);
+    Mat coeff;
+    for (int k = 0; k < length; k++) {
+        Point f = basis.freqs[k];
+        if (rowPass[f.x].empty())
+            sepFilter2D(gray, rowPass[f.x], CV_32F, basis.kernels[f.x], ones, Point(0, 0), 0, BORDER_REPLICATE);
+        sepFilter2D(rowPass[f.x], coeff, CV_32F, ones, basis.kernels[f.y], Point(0, 0), 0, BORDER_REPLICATE);
+
+        float inv = 1.0f / basis.steps[k];
+        short* dst = &out[base + k];
+        for (size_t i = 0; i < positions.size(); i++)
+            dst[i * length] = (short)cvRound(coeff.at<float>(positions[i]) * inv);
+    }
+}
+
+namespace {
+
+struct RowOrder {
+    const short* rows;
+    int length;
+    bool operator()(int a, int b) const {
+        const short* ra = rows + (size_t)a * length;
+        const short* rb = rows + (size_t)b * length;
+        for (int k = 0; k < length; k++) {
+            if (ra[k] != rb[k])
+                return ra[k] < rb[k];
+        }
+        return a < b; // raster order breaks ties, so the order is total
+    }
+};
+
+bool pairBefore(const ClonePair& a, const ClonePair& b) {
+    if (a.dst.y != b.dst.y) return a.dst.y < b.dst.y;
+    if (a.dst.x != b.dst.x) return a.dst.x < b.dst.x;
+    if (a.src.y != b.src.y) return a.src.y < b.src.y;
+    return a.src.x < b.src.x;
+}
+
+}
+
+vector<ClonePair> matchDctFeatures(const vector<short>& rows, int length, const vector<Point>& positions,
+                                   const CloneParams& params, DctMatchStats& stats) {
+    int n = (int)positions.size();
+    stats = DctMatchStats();
+    if (n == 0)
+        return {};
+
+    // Sort chunks in parallel, then merge neighbouring chunks pairwise
+    RowOrder order{ rows.data(), length };
+    vector<int> sorted(n);
+    for (int i = 0; i < n; i++)
+        sorted[i] = i;
+    int chunks = max(1, min(workerCount(params), n / 4096 + 1));
+    vector<int> bounds(chunks + 1);
+    for (int c = 0; c <= chunks; c++)
+        bounds[c] = (int)((int64)n * c / chunks);
+    parallel_for_(Range(0, chunks), [&](const Range& r) {
+        for (int c = r.start; c < r.end; c++)
+            sort(sorted.begin() + bounds[c], sorted.begin() + bounds[c + 1], order);
+    }, parallelStripes(params, chunks));
+    for (int width = 1; width < chunks; width *= 2) {
+        int merges = (chunks + 2 * width - 1) / (2 * width);
+        parallel_for_(Range(0, merges), [&](const Range& r) {
+            for (int m = r.start; m < r.end; m++) {
+                int lo = 2 * width * m;
+                int mid = min(lo + width, chunks), hi = min(lo + 2 * width, chunks);
+                if (mid < hi)
+                    inplace_merge(sorted.begin() + bounds[lo], sorted.begin() + bounds[mid],
+                                  sorted.begin() + bounds[hi], order);
+            }
+        }, parallelStripes(params, merges));
+    }
+
+    int window = max(1, params.dctWindow);
+    int tolerance = max(0, params.dctTolerance);
+    vector<vector<ClonePair>> found(chunks);
+    vector<size_t> rejected(chunks, 0), unique(chunks, 0);
+    parallel_for_(Range(0, chunks), [&](const Range& r) {
+        for (int c = r.start; c < r.end; c++) {
+            for (int s = bounds[c]; s < bounds[c + 1]; s++) {
+                int a = sorted[s];
+                const short* ra = &rows[(size_t)a * length];
+                if (s == 0 || memcmp(ra, &rows[(size_t)sorted[s - 1] * length], length * sizeof(short)) != 0)
+                    unique[c]++;
+                for (int t = s + 1; t < n && t <= s + window; t++) {
+                    int b = sorted[t];
+                    const short* rb = &rows[(size_t)b * length];
+                    // Rows sort by their first coefficient, so later rows only drift further
+                    if (rb[0] - ra[0] > tolerance)
+                        break;
+                    bool close = true;
+                    for (int k = 0; k < length && close; k++)
+                        close = abs(ra[k] - rb[k]) <= tolerance;
+                    if (!close)
+                        continue;
+                    Point src = positions[min(a, b)], dst = positions[max(a, b)];
+                    if (euclideanDistance(src, dst) < params.minDistance) {
+                        rejected[c]++;
+                        continue;
+                    }
+                    found[c].push_back({ src, dst });
+                }
+            }
+        }
+    }, parallelStripes(params, chunks));
+
+    vector<ClonePair> pairs;
+    for (int c = 0; c < chunks; c++) {
+        pairs.insert(pairs.end(), found[c].begin(), found[c].end());
+        stats.rejectedByDistance += rejected[c];
+        stats.uniqueRows += unique[c];
+    }
+    sort(pairs.begin(), pairs.end(), pairBefore);
+    return pairs;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "clone_detector.h"
+
+#include <opencv2/core.hpp>
+#include <vector>
+
+// Block-DCT features in the style of Fridrich et al.: the lowest-frequency
+// coefficients of each block's 2D DCT in zigzag order, quantized coarser as
+// the frequency rises. Similar blocks get similar rather than equal rows, so
+// matching compares neighbours in sorted order instead of exact keys.
+struct DctBasis {
+    int blockSize = 0;
+    std::vector<cv::Point> freqs;    // (horizontal, vertical) frequency per coefficient
+    std::vector<cv::Mat> kernels;    // 1D DCT-II basis per frequency, orthonormal, CV_32F
+    std::vector<float> steps;        // quantization step per coefficient
+
+    void init(int blockSize, int coefficients, double quantStep);
+    int length() const { return (int)freqs.size(); }
+};
+
+// Appends the feature row of the block at each of positions. Positions are
+// relative to gray, which must contain every block.
+void extractDctFeatures(const cv::Mat& gray, const DctBasis& basis,
+                        const std::vector<cv::Point>& positions, std::vector<short>& out);
+
+struct DctMatchStats {
+    size_t uniqueRows = 0;
+    size_t rejectedByDistance = 0;
+};
+
+// Sorts the rows lexicographically and pairs every row with the next window
+// rows whose coefficients all differ by at most tolerance. Rows are indexed in
+// raster order; the earlier block of a pair becomes src. Pairs come out in
+// raster order of dst, then of src, whatever the number of threads.
+std::vector<ClonePair> matchDctFeatures(const std::vector<short>& rows, int length,
+                                        const std::vector<cv::Point>& positions, const CloneParams& params,
+                                        DctMatchStats& stats);
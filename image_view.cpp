@@ -0,0 +1,173 @@
+#include "image_view.h"
+
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+Mat magnify(const Mat& image, Point cursor, int zoom, int zoomSize) {
+    int scale = max(zoom, 1);
+    int cropSize = min(max(zoomSize / scale, 1), min(image.cols, image.rows));
+    int x1 = max(0, min(cursor.x - cropSize / 2, image.cols - cropSize));
+    int y1 = max(0, min(cursor.y - cropSize / 2, image.rows - cropSize));
+
+    Rect roi(x1, y1, cropSize, cropSize);
+    Mat cropped = image(roi);
+
+    Mat zoomed;
+    resize(cropped, zoomed, Size(zoomSize, zoomSize), 0, 0, INTER_LINEAR);
+    return zoomed;
+}
+
+void enhance(Mat& image, const EnhanceParams& params) {
+    if (params.isIdentity())
+        return;
+    Mat work = image;
+    if (params.channel >= 0)
+        extractChannel(image, work, params.channel);
+
+    if (params.equalize || params.clahe) {
+        // Equalize only the luma of colour crops, so hues stay as they are
+        vector<Mat> planes;
+        if (work.channels() == 3) {
+            cvtColor(work, work, COLOR_BGR2YCrCb);
+            split(work, planes);
+        } else {
+            planes.push_back(work);
+        }
+        if (params.equalize)
+            equalizeHist(planes[0], planes[0]);
+        if (params.clahe) {
+            static thread_local Ptr<CLAHE> clahe = createCLAHE(2.0, Size(8, 8));
+            clahe->apply(planes[0], planes[0]);
+        }
+        if (work.channels() == 3) {
+            merge(planes, work);
+            cvtColor(work, work, COLOR_YCrCb2BGR);
+        } else {
+            work = planes[0];
+        }
+    }
+    if (params.gamma != 1.0 && params.gamma > 0) {
+        Mat table(1, 256, CV_8U);
+        for (int i = 0; i < 256; i++)
+            table.at<uchar>(i) = saturate_cast<uchar>(pow(i / 255.0, 1.0 / params.gamma) * 255.0);
+        LUT(work, table, work);
+    }
+    if (params.unsharp > 0) {
+        Mat blurred;
+        GaussianBlur(work, blurred, Size(), 2.0);
+        addWeighted(work, 1.0 + params.unsharp, blurred, -params.unsharp, 0, work);
+    }
+
+    if (work.channels() == 1)
+        cvtColor(work, image, COLOR_GRAY2BGR);
+    else
+        image = work;
+}
+
+const Mat* EnhanceCache::find(const Rect2d& roi, Size out, int interpolation, const EnhanceParams& params) {
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->roi == roi && it->out == out && it->interpolation == interpolation && it->params == params) {
+            entries_.splice(entries_.begin(), entries_, it);
+            return &entries_.front().image;
+        }
+    }
+    return nullptr;
+}
+
+void EnhanceCache::insert(const Rect2d& roi, Size out, int interpolation, const EnhanceParams& params,
+                          const Mat& image) {
+    entries_.push_front({roi, out, interpolation, params, image});
+    if (entries_.size() > max(capacity_, (size_t)2))
+        entries_.pop_back();
+}
+
+Mat EnhanceCache::get(const Rect2d& roi, Size out, int interpolation, const EnhanceParams& params,
+                      const function<Mat()>& render) {
+    if (const Mat* hit = find(roi, out, interpolation, params))
+        return hit->clone();
+
+    EnhanceParams raw;
+    Mat image;
+    if (const Mat* crop = find(roi, out, interpolation, raw)) {
+        image = crop->clone();
+    } else {
+        image = render();
+        insert(roi, out, interpolation, raw, image.clone());
+    }
+    if (!params.isIdentity()) {
+        enhance(image, params);
+        insert(roi, out, interpolation, params, image.clone());
+    }
+    return image;
+}
+
+AsyncRenderer::AsyncRenderer() : worker_(&AsyncRenderer::run, this) {}
+
+AsyncRenderer::~AsyncRenderer() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_one();
+    worker_.join();
+}
+
+void AsyncRenderer::post(Point anchor, Job job) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (job_)
+            skipped_++;
+        job_ = move(job);
+        anchor_ = anchor;
+        postedTick_ = getTickCount();
+    }
+    wake_.notify_one();
+}
+
+bool AsyncRenderer::take(Frame& frame) {
+    lock_guard<mutex> lock(mutex_);
+    if (!frameReady_)
+        return false;
+    frame = move(frame_);
+    frameReady_ = false;
+    return true;
+}
+
+void AsyncRenderer::run() {
+    unique_lock<mutex> lock(mutex_);
+    while (true) {
+        wake_.wait(lock, [this] { return stop_ || job_; });
+        if (stop_)
+            return;
+        Frame next;
+        Job job = move(job_);
+        job_ = nullptr;
+        next.anchor = anchor_;
+        next.postedTick = postedTick_;
+        next.skipped = skipped_;
+        skipped_ = 0;
+
+        lock.unlock();
+        int64 start = getTickCount();
+        next.image = job();
+        next.renderMs = (getTickCount() - start) * 1000.0 / getTickFrequency();
+        lock.lock();
+
+        // An untaken frame is superseded too
+        if (frameReady_)
+            next.skipped += frame_.skipped + 1;
+        frame_ = move(next);
+        frameReady_ = true;
+    }
+}
+
+void drawFrameTiming(Mat& image, const AsyncRenderer::Frame& frame) {
+    double latencyMs = (getTickCount() - frame.postedTick) * 1000.0 / getTickFrequency();
+    string text = format("render %.1f ms, latency %.1f ms, %zu skipped", frame.renderMs, latencyMs, frame.skipped);
+    rectangle(image, Rect(0, 0, image.cols, 16), Scalar(0, 0, 0), FILLED);
+    putText(image, text, Point(4, 12), FONT_HERSHEY_SIMPLEX, 0.35, Scalar(0, 255, 0), 1);
+}
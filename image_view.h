@@ -0,0 +1,109 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+
+// Square crop of zoomSize / zoom pixels centred on the cursor (clamped to the
+// image), scaled back up to zoomSize x zoomSize
+cv::Mat magnify(const cv::Mat& image, cv::Point cursor, int zoom, int zoomSize);
+
+// Filters for a zoomed crop, applied in field order. All off is the identity.
+struct EnhanceParams {
+    int channel = -1;      // 0, 1 or 2 shows that BGR channel alone as gray; -1 all
+    bool equalize = false; // histogram equalization of the luma
+    bool clahe = false;    // contrast-limited adaptive equalization of the luma
+    double gamma = 1.0;
+    double unsharp = 0;    // unsharp-mask amount; 0 is off
+
+    bool isIdentity() const {
+        return channel < 0 && !equalize && !clahe && gamma == 1.0 && unsharp == 0;
+    }
+    bool operator==(const EnhanceParams& o) const {
+        return channel == o.channel && equalize == o.equalize && clahe == o.clahe &&
+               gamma == o.gamma && unsharp == o.unsharp;
+    }
+};
+
+// Enhances a BGR crop in place. Histograms are those of the crop, not of
+// the whole image.
+void enhance(cv::Mat& image, const EnhanceParams& params);
+
+// Recent zoom crops keyed by source region, output size, interpolation and
+// filters. Raw crops are kept under the identity filters, so changing a
+// filter reuses the crop instead of rendering it again, and returning to a
+// region or setting already shown costs a lookup. Not thread-safe; keep one
+// per render thread.
+class EnhanceCache {
+public:
+    explicit EnhanceCache(size_t capacity = 32) : capacity_(capacity) {}
+
+    // render() produces the raw crop of roi at size out on a miss
+    cv::Mat get(const cv::Rect2d& roi, cv::Size out, int interpolation, const EnhanceParams& params,
+                const std::function<cv::Mat()>& render);
+
+private:
+    struct Entry {
+        cv::Rect2d roi;
+        cv::Size out;
+        int interpolation;
+        EnhanceParams params;
+        cv::Mat image;
+    };
+
+    const cv::Mat* find(const cv::Rect2d& roi, cv::Size out, int interpolation, const EnhanceParams& params);
+    void insert(const cv::Rect2d& roi, cv::Size out, int interpolation, const EnhanceParams& params,
+                const cv::Mat& image);
+
+    size_t capacity_;
+    std::list<Entry> entries_; // most recent first
+};
+
+// Renders frames on a worker thread, always from the newest request. A
+// request posted while a frame renders replaces any request still waiting,
+// so a burst of mouse moves costs one frame instead of one per event and the
+// frame shown trails the cursor by at most one render. Showing the frame is
+// left to the caller, since HighGUI windows belong to the GUI thread: post()
+// from the mouse callback, then poll take() from the waitKey() loop.
+class AsyncRenderer {
+public:
+    struct Frame {
+        cv::Mat image;
+        cv::Point anchor;       // as passed to post()
+        int64_t postedTick = 0; // cv::getTickCount() at post()
+        double renderMs = 0;
+        size_t skipped = 0;     // requests replaced before they were rendered
+    };
+    // Runs on the worker thread; capture what it reads by value
+    typedef std::function<cv::Mat()> Job;
+
+    AsyncRenderer();
+    ~AsyncRenderer();
+    AsyncRenderer(const AsyncRenderer&) = delete;
+    AsyncRenderer& operator=(const AsyncRenderer&) = delete;
+
+    void post(cv::Point anchor, Job job);
+    // The newest finished frame, once; false if none finished since the last call
+    bool take(Frame& frame);
+
+private:
+    void run();
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stop_ = false;
+    Job job_;
+    cv::Point anchor_;
+    int64_t postedTick_ = 0;
+    size_t skipped_ = 0;
+    bool frameReady_ = false;
+    Frame frame_;
+    std::thread worker_; // last, so it starts after the state above
+};
+
+// Render time and input-to-display latency in the frame's top-left corner
+void drawFrameTiming(cv::Mat& image, const AsyncRenderer::Frame& frame);
@@ -0,0 +1,167 @@
+#include "keypoint_matcher.h"
+
+#include <opencv2/imgproc.hpp>
+#include <opencv2/features2d.hpp>
+#include <opencv2/flann.hpp>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <unordered_map>
+
+using namespace cv;
+using namespace std;
+
+void detectKeypoints(const Mat& image, const CloneParams& params, vector<Point2f>& points, Mat& descriptors) {
+    Mat gray;
+    cvtColor(image, gray, COLOR_BGR2GRAY);
+    int maxKeypoints = max(1, params.maxKeypoints);
+    Ptr<Feature2D> detector;
+    if (params.keypointType == KEYPOINT_SIFT)
+        detector = SIFT::create(maxKeypoints);
+    else
+        detector = ORB::create(maxKeypoints);
+    vector<KeyPoint> keypoints;
+    detector->detectAndCompute(gray, Mat(), keypoints, descriptors);
+    points.resize(keypoints.size());
+    for (size_t i = 0; i < keypoints.size(); i++)
+        points[i] = keypoints[i].pt;
+}
+
+static bool rasterLess(Point2f a, Point2f b) {
+    return a.y != b.y ? a.y < b.y : a.x < b.x;
+}
+
+vector<ClonePair> matchKeypoints(const vector<Point2f>& points, const Mat& descriptors,
+                                 const CloneParams& params, KeypointMatchStats& stats) {
+    stats = KeypointMatchStats();
+    int n = (int)points.size();
+    if (n < 2 || descriptors.rows != n)
+        return vector<ClonePair>();
+
+    // Binary ORB descriptors need an LSH index; SIFT's float ones a k-d tree
+    int k = min(n, 10);
+    vector<vector<DMatch>> neighbours;
+    if (descriptors.depth() == CV_8U) {
+        FlannBasedMatcher matcher(makePtr<flann::LshIndexParams>(12, 20, 2));
+        matcher.knnMatch(descriptors, descriptors, neighbours, k);
+    } else {
+        FlannBasedMatcher matcher;
+        matcher.knnMatch(descriptors, descriptors, neighbours, k);
+    }
+
+    vector<pair<int, int>> matches;
+    vector<DMatch> others;
+    for (const auto& list : neighbours) {
+        others.clear();
+        for (const DMatch& m : list) {
+            if (m.trainIdx != m.queryIdx)
+                others.push_back(m);
+        }
+        // d_i is accepted while it is well below d_(i+1); equal zeros are
+        // identical descriptors, which always match
+        for (size_t i = 0; i + 1 < others.size(); i++) {
+            if (others[i].distance > 0 && others[i].distance >= params.g2nnRatio * others[i + 1].distance)
+                break;
+            int a = others[i].queryIdx, b = others[i].trainIdx;
+            if (rasterLess(points[b], points[a]))
+                swap(a, b);
+            matches.push_back({ a, b });
+        }
+    }
+    sort(matches.begin(), matches.end());
+    matches.erase(unique(matches.begin(), matches.end()), matches.end());
+    stats.matches = matches.size();
+
+    int half = params.blockSize / 2;
+    vector<ClonePair> pairs;
+    for (const auto& m : matches) {
+        Point2f a = points[m.first], b = points[m.second];
+        if (hypot(a.x - b.x, a.y - b.y) < params.minDistance) {
+            stats.rejectedByDistance++;
+            continue;
+        }
+        pairs.push_back({ Point(cvRound(a.x) - half, cvRound(a.y) - half),
+                          Point(cvRound(b.x) - half, cvRound(b.y) - half) });
+    }
+    sort(pairs.begin(), pairs.end(), [](const ClonePair& p, const ClonePair& q) {
+        if (p.dst.y != q.dst.y) return p.dst.y < q.dst.y;
+        if (p.dst.x != q.dst.x) return p.dst.x < q.dst.x;
+        return p.src.y != q.src.y ? p.src.y < q.src.y : p.src.x < q.src.x;
+    });
+    return pairs;
+}
+
+static double squaredDistance(Point a, Point b) {
+    double dx = a.x - b.x, dy = a.y - b.y;
+    return dx * dx + dy * dy;
+}
+
+static int findRoot(vector<int>& parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+vector<vector<ClonePair>> clusterKeypointPairs(const vector<ClonePair>& pairs, int minClusterSize, double radius) {
+    int n = (int)pairs.size();
+    vector<int> parent(n);
+    iota(parent.begin(), parent.end(), 0);
+    double r2 = radius * radius;
+    auto joins = [&](const ClonePair& p, const ClonePair& q) {
+        return (squaredDistance(p.src, q.src) <= r2 && squaredDistance(p.dst, q.dst) <= r2)
+            || (squaredDistance(p.src, q.dst) <= r2 && squaredDistance(p.dst, q.src) <= r2);
+    };
+
+    // Both ends of every pair go into a grid of cells one radius wide, so a
+    // pair only visits the 3x3 cells around each of its ends
+    int cell = max(1, (int)ceil(radius));
+    auto cellKey = [cell](int cx, int cy) { return ((uint64_t)(uint32_t)cx << 32) | (uint32_t)cy; };
+    unordered_map<uint64_t, vector<int>> grid;
+    for (int i = 0; i < n; i++) {
+        for (Point end : { pairs[i].src, pairs[i].dst }) {
+            int cx = (int)floor((double)end.x / cell), cy = (int)floor((double)end.y / cell);
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    auto it = grid.find(cellKey(cx + dx, cy + dy));
+                    if (it == grid.end())
+                        continue;
+                    for (int j : it->second) {
+                        int ri = findRoot(parent, i), rj = findRoot(parent, j);
+                        if (ri != rj && joins(pairs[i], pairs[j]))
+                            parent[max(ri, rj)] = min(ri, rj);
+                    }
+                }
+            }
+            grid[cellKey(cx, cy)].push_back(i);
+        }
+    }
+
+    // Clusters in order of their first pair
+    vector<int> clusterOf(n, -1);
+    vector<vector<ClonePair>> groups;
+    for (int i = 0; i < n; i++) {
+        int root = findRoot(parent, i);
+        if (clusterOf[root] < 0) {
+            clusterOf[root] = (int)groups.size();
+            groups.emplace_back();
+        }
+        groups[clusterOf[root]].push_back(pairs[i]);
+    }
+    vector<vector<ClonePair>> clusters;
+    for (auto& group : groups) {
+        if ((int)group.size() < minClusterSize)
+            continue;
+        ClonePair ref = group[0];
+        if (ref.dst.y != ref.src.y ? ref.dst.y < ref.src.y : ref.dst.x < ref.src.x)
+            swap(ref.src, ref.dst);
+        for (ClonePair& p : group) {
+            if (squaredDistance(p.src, ref.dst) + squaredDistance(p.dst, ref.src)
+                < squaredDistance(p.src, ref.src) + squaredDistance(p.dst, ref.dst))
+                swap(p.src, p.dst);
+        }
+        clusters.push_back(move(group));
+    }
+    return clusters;
+}
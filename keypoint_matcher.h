@@ -0,0 +1,37 @@
+#pragma once
+
+#include "clone_detector.h"
+
+#include <opencv2/core.hpp>
+#include <vector>
+
+// Keypoint engine in the style of Amerini et al.: ORB or SIFT keypoints of
+// the whole image, matched against each other with FLANN and the generalized
+// 2NN test, then grouped by where both ends of each match lie. Rotated and
+// scaled copies still match, and the work grows with the keypoint count
+// instead of with the number of blocks.
+
+// Up to params.maxKeypoints of the strongest keypoints and their descriptors
+void detectKeypoints(const cv::Mat& image, const CloneParams& params,
+                     std::vector<cv::Point2f>& points, cv::Mat& descriptors);
+
+struct KeypointMatchStats {
+    size_t matches = 0;            // accepted by g2NN, before the distance check
+    size_t rejectedByDistance = 0;
+};
+
+// g2NN: the nearest other descriptors d1 <= d2 <= ... are accepted in order
+// while d_i / d_(i+1) stays below params.g2nnRatio, so a region copied
+// several times matches every copy. Each match is kept once, with the earlier
+// keypoint in raster order as src. Pair positions are the keypoints moved up
+// and left by half a block, so drawn blocks are centred on them. Pairs come
+// out in raster order of dst, then of src.
+std::vector<ClonePair> matchKeypoints(const std::vector<cv::Point2f>& points, const cv::Mat& descriptors,
+                                      const CloneParams& params, KeypointMatchStats& stats);
+
+// Union-find over the pairs: two pairs join when their ends lie within radius
+// of each other, in either orientation. Needs no common displacement, so a
+// rotated or scaled copy stays one cluster. Pairs in a cluster are turned to
+// face the same way, src on the side of the earlier end of its first pair.
+std::vector<std::vector<ClonePair>> clusterKeypointPairs(const std::vector<ClonePair>& pairs, int minClusterSize,
+                                                         double radius);
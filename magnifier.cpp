@@ -1,72 +1,177 @@
+#include "image_view.h"
+#include "tile_pyramid.h"
+
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <cstdlib>
 #include <string>
 
 using namespace cv;
 using namespace std;
 
-const string imagePath = "your image path";
+const string defaultImagePath = "your image path";
 const string mainWindow = "Image Viewer";
 const string zoomWindow = "Zoomed View";
 const string controlWindow = "Zoom Control";
+const Size maxViewSize(1280, 800);
 
-Mat originalImage, displayedImage;
-int zoomSlider = 1;           // Default zoom 1x
+// The image is never loaded whole: both windows are rendered from the tiles
+// under them, so panning and zooming cost the same on any image size.
+TilePyramid pyramid;
+EnhanceCache zoomCache;   // used by the render thread only
+// The zoom window is rendered off the GUI thread, from the newest cursor
+// position only; declared last so it stops before what it reads goes away
+AsyncRenderer zoomRenderer;
+bool viewDirty = false;   // main view is redrawn once per event loop pass
+Size viewSize;            // main window, in screen pixels
+Point2d viewCenter;       // full-size image point at the window centre
+double viewScale = 1;     // full-size pixels per screen pixel
+double fitScale = 1;      // viewScale that shows the whole image
+Point cursor(-1, -1);
+Point dragStart;
+Point2d dragCenter;
+int zoomSlider = 8;           // Default zoom 1x; zoom is 2^((slider - 8) / 4)
+int cubicSlider = 0;          // magnified pixels: 0 nearest, 1 bicubic
+// Enhancements of the zoom window only
 int equalizeSlider = 0;       // 0: OFF, 1: ON
-const int maxZoom = 10;
+int claheSlider = 0;
+int gammaSlider = 10;         // gamma x 10
+int unsharpSlider = 0;        // unsharp-mask amount x 10
+int channelSlider = 0;        // 0: all, 1: blue, 2: green, 3: red
+int timingSlider = 0;         // render time and latency on the zoom window
+const int maxZoom = 32;        // 64x
 int zoomSize = 200;
 
-void applyHistogramEqualization() {
-    if (equalizeSlider == 1) {
-        // Convert to YCrCb and equalize only the Y channel
-        Mat ycrcb;
-        cvtColor(originalImage, ycrcb, COLOR_BGR2YCrCb);
+EnhanceParams sliderEnhancements() {
+    EnhanceParams params;
+    params.channel = channelSlider - 1;
+    params.equalize = (equalizeSlider == 1);
+    params.clahe = (claheSlider == 1);
+    params.gamma = max(gammaSlider, 1) / 10.0;
+    params.unsharp = unsharpSlider / 10.0;
+    return params;
+}
 
-        vector<Mat> channels;
-        split(ycrcb, channels);
-        equalizeHist(channels[0], channels[0]);
-        merge(channels, ycrcb);
+// Four slider steps per doubling, from 0.25x at 0 to 64x at maxZoom
+double zoomFactor() {
+    return pow(2.0, (zoomSlider - 8) / 4.0);
+}
 
-        cvtColor(ycrcb, displayedImage, COLOR_YCrCb2BGR);
-    } else {
-        displayedImage = originalImage.clone();
-    }
-    imshow(mainWindow, displayedImage);
+Rect2d viewRect() {
+    double w = viewSize.width * viewScale, h = viewSize.height * viewScale;
+    return Rect2d(viewCenter.x - w / 2, viewCenter.y - h / 2, w, h);
 }
 
-void onMouse(int event, int x, int y, int, void*) {
-    if (event != EVENT_MOUSEMOVE)
+void showView() {
+    Mat view = pyramid.render(viewRect(), viewSize);
+    imshow(mainWindow, view);
+}
+
+// Queues the zoom window for the render thread; the loop in main() shows it
+void showZoom() {
+    if (cursor.x < 0)
         return;
+    // Square of zoomSize / zoom full-size pixels under the cursor, clamped to the image
+    Size full = pyramid.size();
+    Rect2d view = viewRect();
+    double atX = view.x + (cursor.x + 0.5) * viewScale, atY = view.y + (cursor.y + 0.5) * viewScale;
+    double crop = min(zoomSize / zoomFactor(), (double)min(full.width, full.height));
+    double x1 = max(0.0, min(atX - crop / 2, full.width - crop));
+    double y1 = max(0.0, min(atY - crop / 2, full.height - crop));
 
-    int scale = max(zoomSlider, 1);
-    int cropSize = zoomSize / scale;
-    int x1 = max(0, min(x - cropSize / 2, displayedImage.cols - cropSize));
-    int y1 = max(0, min(y - cropSize / 2, displayedImage.rows - cropSize));
+    Rect2d roi(x1, y1, crop, crop);
+    Size size(zoomSize, zoomSize);
+    EnhanceParams enhancements = sliderEnhancements();
+    // Below 1x the pyramid supplies the nearest coarser level, so each output
+    // pixel reads at most a 2x2 area; above it pixels are only enlarged
+    int interpolation = zoomFactor() < 1 ? INTER_LINEAR : (cubicSlider == 1 ? INTER_CUBIC : INTER_NEAREST);
+    zoomRenderer.post(cursor, [roi, size, interpolation, enhancements] {
+        return zoomCache.get(roi, size, interpolation, enhancements,
+                             [&] { return pyramid.render(roi, size, interpolation); });
+    });
+}
 
-    Rect roi(x1, y1, cropSize, cropSize);
-    Mat cropped = displayedImage(roi);
+void showZoomFrame(AsyncRenderer::Frame& frame) {
+    if (timingSlider == 1)
+        drawFrameTiming(frame.image, frame);
+    moveWindow(zoomWindow, frame.anchor.x + 20, frame.anchor.y + 20);
+    imshow(zoomWindow, frame.image);
+}
 
-    Mat zoomed;
-    resize(cropped, zoomed, Size(zoomSize, zoomSize), 0, 0, INTER_LINEAR);
+// Keeps the window centre on the image
+void clampView() {
+    Size full = pyramid.size();
+    viewCenter.x = min(max(viewCenter.x, 0.0), (double)full.width);
+    viewCenter.y = min(max(viewCenter.y, 0.0), (double)full.height);
+}
 
-    moveWindow(zoomWindow, x + 20, y + 20);
-    imshow(zoomWindow, zoomed);
+void zoomView(double factor) {
+    viewScale = min(max(viewScale * factor, 1.0 / 16), max(fitScale, 1.0));
+    showView();
+    showZoom();
+}
+
+void onMouse(int event, int x, int y, int flags, void*) {
+    if (event == EVENT_LBUTTONDOWN) {
+        dragStart = Point(x, y);
+        dragCenter = viewCenter;
+        return;
+    }
+    if (event == EVENT_MOUSEWHEEL) {
+        int steps = getMouseWheelDelta(flags) > 0 ? 1 : -1;
+        setTrackbarPos("Zoom (0.25x-64x)", controlWindow, min(max(zoomSlider + steps, 0), maxZoom));
+        return;
+    }
+    if (event != EVENT_MOUSEMOVE)
+        return;
+
+    if (flags & EVENT_FLAG_LBUTTON) {
+        viewCenter = Point2d(dragCenter.x - (x - dragStart.x) * viewScale,
+                             dragCenter.y - (y - dragStart.y) * viewScale);
+        clampView();
+        viewDirty = true;
+    }
+    cursor = Point(x, y);
+    showZoom();
 }
 
 void onZoomChange(int, void*) {
-    applyHistogramEqualization();  // Update zoomed view with latest image
+    showZoom();
 }
 
-void onEqualizeChange(int, void*) {
-    applyHistogramEqualization();  // Toggle equalization and update view
+void onEnhanceChange(int, void*) {
+    showZoom();  // Only the zoom window is enhanced
 }
 
-int main() {
-    originalImage = imread(imagePath);
-    if (originalImage.empty()) {
+int main(int argc, char** argv) {
+    // magnifier [<image>] [--tile-cache DIR] [--tile-cache-mb N]
+    string imagePath = defaultImagePath;
+    string tileCacheDir;
+    size_t tileCacheMB = 8192;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--tile-cache" && i + 1 < argc)
+            tileCacheDir = argv[++i];
+        else if (arg == "--tile-cache-mb" && i + 1 < argc)
+            tileCacheMB = (size_t)max(0, atoi(argv[++i]));
+        else
+            imagePath = arg;
+    }
+    // Without --tile-cache the tiles go to a temporary file removed on exit
+    if (!tileCacheDir.empty())
+        pyramid.setCacheDir(tileCacheDir, tileCacheMB << 20);
+    // The first open of an image builds its tile cache, which takes one pass over it
+    if (!pyramid.open(imagePath)) {
         cerr << "Error loading image: " << imagePath << endl;
         return -1;
     }
+    Size full = pyramid.size();
+    fitScale = max(1.0, max((double)full.width / maxViewSize.width, (double)full.height / maxViewSize.height));
+    viewSize = Size(max(cvRound(full.width / fitScale), 1), max(cvRound(full.height / fitScale), 1));
+    viewScale = fitScale;
+    viewCenter = Point2d(full.width / 2.0, full.height / 2.0);
 
     namedWindow(mainWindow);
     namedWindow(zoomWindow);
@@ -74,11 +179,40 @@ int main() {
     setMouseCallback(mainWindow, onMouse);
 
     namedWindow(controlWindow);
-    createTrackbar("Zoom (1x-10x)", controlWindow, &zoomSlider, maxZoom, onZoomChange);
-    createTrackbar("Equalize Hist", controlWindow, &equalizeSlider, 1, onEqualizeChange);
+    createTrackbar("Zoom (0.25x-64x)", controlWindow, &zoomSlider, maxZoom, onZoomChange);
+    createTrackbar("Bicubic", controlWindow, &cubicSlider, 1, onZoomChange);
+    createTrackbar("Equalize Hist", controlWindow, &equalizeSlider, 1, onEnhanceChange);
+    createTrackbar("CLAHE", controlWindow, &claheSlider, 1, onEnhanceChange);
+    createTrackbar("Gamma x10", controlWindow, &gammaSlider, 40, onEnhanceChange);
+    setTrackbarMin("Gamma x10", controlWindow, 1);
+    createTrackbar("Unsharp x10", controlWindow, &unsharpSlider, 30, onEnhanceChange);
+    createTrackbar("Channel (all/B/G/R)", controlWindow, &channelSlider, 3, onEnhanceChange);
+    createTrackbar("Show Timing", controlWindow, &timingSlider, 1);
 
-    applyHistogramEqualization(); // Show the default image
-    waitKey(0);
+    showView(); // Show the whole image
+    // Drag to pan, + and - to zoom the view, 0 to fit, ESC to quit. The short
+    // wait keeps up with the display while picking up finished zoom frames.
+    while (true) {
+        int key = waitKey(5);
+        if (key == 27 || getWindowProperty(mainWindow, WND_PROP_VISIBLE) < 1)
+            break;
+        if (viewDirty) {
+            viewDirty = false;
+            showView();
+        }
+        AsyncRenderer::Frame frame;
+        if (zoomRenderer.take(frame) && !frame.image.empty())
+            showZoomFrame(frame);
+
+        if (key == '+' || key == '=') {
+            zoomView(0.5);
+        } else if (key == '-') {
+            zoomView(2.0);
+        } else if (key == '0') {
+            viewCenter = Point2d(full.width / 2.0, full.height / 2.0);
+            zoomView(fitScale / viewScale);
+        }
+    }
     destroyAllWindows();
     return 0;
 }
@@ -0,0 +1,119 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+#ifdef _WIN32
+bool MappedFile::openRead(const string& path) {
+    close();
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    file_ = file;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        close();
+        return false;
+    }
+    mapping_ = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_)
+        data_ = (uchar*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+    if (!data_) {
+        close();
+        return false;
+    }
+    size_ = (size_t)size.QuadPart;
+    return true;
+}
+
+bool MappedFile::create(const string& path, size_t size) {
+    close();
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    file_ = file;
+    // Mapping past the end of the file grows it, zero-filled
+    mapping_ = CreateFileMappingA(file, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32),
+                                  (DWORD)size, nullptr);
+    if (mapping_)
+        data_ = (uchar*)MapViewOfFile(mapping_, FILE_MAP_WRITE, 0, 0, size);
+    if (!data_) {
+        close();
+        return false;
+    }
+    size_ = size;
+    return true;
+}
+
+bool MappedFile::flush() {
+    return data_ && FlushViewOfFile(data_, size_) && FlushFileBuffers((HANDLE)file_);
+}
+
+void MappedFile::close() {
+    if (data_) UnmapViewOfFile(data_);
+    if (mapping_) CloseHandle((HANDLE)mapping_);
+    if (file_) CloseHandle((HANDLE)file_);
+    data_ = nullptr;
+    mapping_ = file_ = nullptr;
+    size_ = 0;
+}
+#else
+bool MappedFile::openRead(const string& path) {
+    close();
+    fd_ = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0 || st.st_size == 0) {
+        close();
+        return false;
+    }
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED) {
+        close();
+        return false;
+    }
+    data_ = (uchar*)data;
+    size_ = (size_t)st.st_size;
+    return true;
+}
+
+bool MappedFile::create(const string& path, size_t size) {
+    close();
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0 || ftruncate(fd_, (off_t)size) != 0) {
+        close();
+        return false;
+    }
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED) {
+        close();
+        return false;
+    }
+    data_ = (uchar*)data;
+    size_ = size;
+    return true;
+}
+
+bool MappedFile::flush() {
+    return data_ && msync(data_, size_, MS_SYNC) == 0;
+}
+
+void MappedFile::close() {
+    if (data_) munmap(data_, size_);
+    if (fd_ >= 0) ::close(fd_);
+    data_ = nullptr;
+    size_ = 0;
+    fd_ = -1;
+}
+#endif
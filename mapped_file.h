@@ -0,0 +1,34 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <string>
+
+// Read-only or writable view of a whole file in memory (mmap on POSIX,
+// MapViewOfFile on Windows)
+class MappedFile {
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool openRead(const std::string& path);
+    // Creates or truncates the file to size zero-filled bytes, mapped writable
+    bool create(const std::string& path, size_t size);
+    // Writes dirty pages back to the file
+    bool flush();
+    void close();
+
+    uchar* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    uchar* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
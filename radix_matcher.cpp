@@ -0,0 +1,174 @@
+#include "radix_matcher.h"
+
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+namespace {
+
+struct KeyIndex {
+    uint64_t key;
+    uint32_t index; // raster position among all kept blocks
+};
+
+// Stable LSD radix sort on 8-bit digits. Each chunk histograms its part of
+// the array; offsets are laid out digit-major, chunk-minor, so the scatter
+// keeps the input order of equal digits. Passes where every key has the same
+// digit are skipped. At most `stripes` chunks run at once.
+void radixSort(vector<KeyIndex>& data, vector<KeyIndex>& scratch, int chunks, double stripes) {
+    size_t n = data.size();
+    scratch.resize(n);
+    vector<size_t> bounds(chunks + 1);
+    for (int c = 0; c <= chunks; c++)
+        bounds[c] = n * c / chunks;
+    vector<size_t> offsets((size_t)chunks * 256);
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        fill(offsets.begin(), offsets.end(), 0);
+        parallel_for_(Range(0, chunks), [&](const Range& r) {
+            for (int c = r.start; c < r.end; c++) {
+                size_t* hist = &offsets[(size_t)c * 256];
+                for (size_t i = bounds[c]; i < bounds[c + 1]; i++)
+                    hist[(data[i].key >> shift) & 0xff]++;
+            }
+        }, stripes);
+
+        size_t sum = 0;
+        bool trivial = false;
+        for (int d = 0; d < 256; d++) {
+            size_t digitTotal = 0;
+            for (int c = 0; c < chunks; c++) {
+                size_t count = offsets[(size_t)c * 256 + d];
+                offsets[(size_t)c * 256 + d] = sum;
+                sum += count;
+                digitTotal += count;
+            }
+            trivial = trivial || digitTotal == n;
+        }
+        if (trivial)
+            continue;
+
+        parallel_for_(Range(0, chunks), [&](const Range& r) {
+            for (int c = r.start; c < r.end; c++) {
+                size_t* next = &offsets[(size_t)c * 256];
+                for (size_t i = bounds[c]; i < bounds[c + 1]; i++)
+                    scratch[next[(data[i].key >> shift) & 0xff]++] = data[i];
+            }
+        }, stripes);
+        data.swap(scratch);
+    }
+}
+
+}
+
+vector<ClonePair> matchSortedKeys(vector<ScanBand>& bands, const CloneParams& params, SortedMatchStats& stats) {
+    stats = SortedMatchStats();
+    vector<size_t> bandStart(bands.size() + 1, 0);
+    for (size_t b = 0; b < bands.size(); b++)
+        bandStart[b + 1] = bandStart[b] + bands[b].records.size();
+    size_t n = bandStart.back();
+
+    vector<KeyIndex> sorted(n), scratch;
+    vector<Point> positions(n);
+    parallel_for_(Range(0, (int)bands.size()), [&](const Range& r) {
+        for (int b = r.start; b < r.end; b++) {
+            for (size_t i = 0; i < bands[b].records.size(); i++) {
+                size_t k = bandStart[b] + i;
+                sorted[k] = { bands[b].records[i].key, (uint32_t)k };
+                positions[k] = bands[b].records[i].pos;
+            }
+        }
+    }, parallelStripes(params, (int)bands.size()));
+
+    int chunks = max(1, min(workerCount(params) * 4, (int)(n / 65536) + 1));
+    double stripes = parallelStripes(params, chunks);
+    radixSort(sorted, scratch, chunks, stripes);
+
+    // Chunks of whole runs, so no run is split between tasks
+    vector<size_t> runBounds(chunks + 1, n);
+    for (int c = 0; c < chunks; c++) {
+        size_t i = n * c / chunks;
+        while (i > 0 && i < n && sorted[i].key == sorted[i - 1].key)
+            i++;
+        runBounds[c] = i;
+    }
+
+    bool matchAll = params.matchMode == MATCH_ALL;
+    int cap = max(1, params.maxOccurrences);
+    vector<int> counts(n, 0);
+    vector<uchar> painted(n, 1);
+    vector<size_t> rejected(chunks, 0), runs(chunks, 0);
+
+    // Calls emit(dst, src) for every pair in the run starting at s, in the
+    // order the hash path would produce them for that dst
+    auto forEachPair = [&](size_t s, size_t e, auto emit, auto reject) {
+        Point first = positions[sorted[s].index];
+        for (size_t k = s + 1; k < e; k++) {
+            uint32_t dst = sorted[k].index;
+            const Point& p = positions[dst];
+            bool tooClose = euclideanDistance(first, p) < params.minDistance;
+            if (!matchAll) {
+                if (tooClose)
+                    reject(dst);
+                else
+                    emit(dst, first);
+                continue;
+            }
+            if (k - s >= (size_t)cap)
+                continue;
+            for (size_t j = s; j < k; j++) {
+                const Point& src = positions[sorted[j].index];
+                if (euclideanDistance(src, p) < params.minDistance)
+                    reject(dst);
+                else
+                    emit(dst, src);
+            }
+        }
+    };
+
+    // Count pairs per dst, then place them by prefix sums
+    parallel_for_(Range(0, chunks), [&](const Range& r) {
+        for (int c = r.start; c < r.end; c++) {
+            for (size_t s = runBounds[c], e; s < runBounds[c + 1]; s = e) {
+                for (e = s + 1; e < n && sorted[e].key == sorted[s].key; e++) {}
+                runs[c]++;
+                if (e - s == 1) continue;
+                Point first = positions[sorted[s].index];
+                for (size_t k = s + 1; k < e; k++) {
+                    if (euclideanDistance(first, positions[sorted[k].index]) < params.minDistance)
+                        painted[sorted[k].index] = 0;
+                }
+                forEachPair(s, e, [&](uint32_t dst, Point) { counts[dst]++; },
+                            [&](uint32_t) { rejected[c]++; });
+            }
+        }
+    }, stripes);
+
+    vector<size_t> pairStart(n + 1, 0);
+    for (size_t k = 0; k < n; k++)
+        pairStart[k + 1] = pairStart[k] + counts[k];
+    vector<ClonePair> pairs(pairStart[n]);
+    fill(counts.begin(), counts.end(), 0); // now the pairs placed per dst
+    parallel_for_(Range(0, chunks), [&](const Range& r) {
+        for (int c = r.start; c < r.end; c++) {
+            for (size_t s = runBounds[c], e; s < runBounds[c + 1]; s = e) {
+                for (e = s + 1; e < n && sorted[e].key == sorted[s].key; e++) {}
+                if (e - s == 1) continue;
+                forEachPair(s, e, [&](uint32_t dst, Point src) {
+                    pairs[pairStart[dst] + counts[dst]++] = { src, positions[dst] };
+                }, [](uint32_t) {});
+            }
+        }
+    }, stripes);
+
+    for (size_t b = 0; b < bands.size(); b++) {
+        bands[b].painted.assign(painted.begin() + bandStart[b], painted.begin() + bandStart[b + 1]);
+        bands[b].pairs.clear();
+    }
+    for (int c = 0; c < chunks; c++) {
+        stats.runs += runs[c];
+        stats.rejectedByDistance += rejected[c];
+    }
+    return pairs;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "clone_detector.h"
+
+#include <vector>
+
+struct SortedMatchStats {
+    size_t runs = 0; // distinct keys
+    size_t rejectedByDistance = 0;
+};
+
+// Exact-key matching without a hash table: the bands' keys go into one flat
+// array, are sorted with a parallel LSD radix sort, and runs of equal keys
+// are paired. The sort is stable, so each run is in raster order and its
+// first entry is the first occurrence. Pairs, their order and the bands'
+// painted flags are the same as from the hash table path, for MATCH_FIRST
+// and MATCH_ALL.
+std::vector<ClonePair> matchSortedKeys(std::vector<ScanBand>& bands, const CloneParams& params,
+                                       SortedMatchStats& stats);
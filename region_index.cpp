@@ -0,0 +1,394 @@
+#include "region_index.h"
+
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <queue>
+#include <sstream>
+#include <unordered_map>
+
+using namespace cv;
+using namespace std;
+namespace fs = std::filesystem;
+
+struct SegmentHeader {
+    char magic[8];
+    uint64_t count;
+    uint64_t imageLimit; // every entry's image id is below this; 0 in older segments
+    uint64_t reserved;
+};
+
+static const char segmentMagic[8] = {'I', 'A', 'I', 'N', 'D', 'E', 'X', '1'};
+
+static double elapsedMs(int64 start) {
+    return (getTickCount() - start) * 1000.0 / getTickFrequency();
+}
+
+static bool entryLess(const IndexEntry& a, const IndexEntry& b) {
+    if (a.key != b.key) return a.key < b.key;
+    if (a.image != b.image) return a.image < b.image;
+    if (a.row != b.row) return a.row < b.row;
+    return a.col < b.col;
+}
+
+vector<BlockRecord> firstBlockKeys(const Mat& image, const CloneParams& params) {
+    int blockSize = max(1, params.blockSize), stepSize = max(1, params.stepSize);
+    vector<BlockRecord> keys;
+    if (image.cols < blockSize || image.rows < blockSize)
+        return keys;
+    int blockRows = (image.rows - blockSize) / stepSize + 1;
+
+    DetailMap detail;
+    detail.compute(image);
+    SampleMap samples;
+    bool useSamples = SampleMap::supports(blockSize);
+    if (useSamples)
+        samples.compute(image, SampleMap::windowFor(blockSize));
+
+    vector<vector<BlockRecord>> rows(blockRows);
+    parallel_for_(Range(0, blockRows), [&](const Range& r) {
+        for (int row = r.start; row < r.end; row++) {
+            int y = row * stepSize;
+            for (int x = 0; x <= image.cols - blockSize; x += stepSize) {
+                if (detail.blockDetail(x, y, blockSize) < params.detailThreshold)
+                    continue;
+                BlockRecord rec;
+                rec.pos = Point(x, y);
+                if (useSamples) {
+                    rec.key = samples.blockKey(x, y, blockSize, rec.cells);
+                } else {
+                    Mat compressed;
+                    rec.key = blockToKey(image(Rect(x, y, blockSize, blockSize)), compressed);
+                    memcpy(rec.cells, compressed.data, sizeof(rec.cells));
+                }
+                rows[row].push_back(rec);
+            }
+        }
+    });
+
+    BlockTable seen;
+    for (const auto& row : rows) {
+        for (const BlockRecord& rec : row) {
+            Point first;
+            if (!seen.findOrInsert(rec.key, rec.pos, first))
+                keys.push_back(rec);
+        }
+    }
+    return keys;
+}
+
+bool RegionIndex::open(const string& dir, const CloneParams& params, bool create) {
+    dir_ = dir;
+    params_ = params;
+    images_.clear();
+    segments_.clear();
+    pending_.clear();
+    pendingImages_.clear();
+
+    fs::path root(dir);
+    ifstream config(root / "index.cfg");
+    if (!config) {
+        if (!create)
+            return false;
+        error_code ec;
+        fs::create_directories(root, ec);
+        ofstream out(root / "index.cfg");
+        out << "blockSize " << params_.blockSize << "\n"
+            << "stepSize " << params_.stepSize << "\n"
+            << "detailThreshold " << params_.detailThreshold << "\n";
+        if (!out)
+            return false;
+    } else {
+        string name;
+        double value;
+        while (config >> name >> value) {
+            if (name == "blockSize") params_.blockSize = (int)value;
+            else if (name == "stepSize") params_.stepSize = (int)value;
+            else if (name == "detailThreshold") params_.detailThreshold = value;
+        }
+    }
+    params_.blockSize = max(1, params_.blockSize);
+    params_.stepSize = max(1, params_.stepSize);
+
+    // A line cut short by a crash ends the list. It is cut off, so the next
+    // append starts on a line of its own.
+    fs::path listPath = root / "images.tsv";
+    ifstream list(listPath, ios::binary);
+    string line;
+    uintmax_t listed = 0; // bytes of complete lines
+    while (getline(list, line) && !list.eof()) {
+        istringstream fields(!line.empty() && line.back() == '\r' ? line.substr(0, line.size() - 1) : line);
+        size_t id;
+        ImageInfo info;
+        if (!(fields >> id >> info.size.width >> info.size.height) || id != images_.size())
+            break;
+        fields.get();
+        if (!getline(fields, info.path))
+            break;
+        images_.push_back(info);
+        listed += line.size() + 1;
+    }
+    list.close();
+    error_code ec;
+    if (fs::exists(listPath, ec) && fs::file_size(listPath, ec) > listed) {
+        fs::resize_file(listPath, listed, ec);
+        if (ec)
+            return false;
+    }
+
+    vector<string> names;
+    for (const auto& file : fs::directory_iterator(root, ec)) {
+        string name = file.path().filename().string();
+        if (name.compare(0, 4, "seg-") == 0 && file.path().extension() == ".bin")
+            names.push_back(file.path().string());
+    }
+    sort(names.begin(), names.end());
+    for (const string& name : names) {
+        if (!mapSegment(name))
+            return false;
+        if (imageLimit(*segments_.back()) > images_.size() && !dropUnlisted())
+            return false;
+    }
+    return true;
+}
+
+size_t RegionIndex::imageLimit(const Segment& segment) {
+    const SegmentHeader* header = (const SegmentHeader*)segment.file.data();
+    if (header->imageLimit > 0 || segment.count == 0)
+        return header->imageLimit;
+    size_t limit = 0;
+    for (size_t i = 0; i < segment.count; i++)
+        limit = max(limit, (size_t)segment.entries[i].image + 1);
+    return limit;
+}
+
+// A crash between flush() writing a segment and listing its images leaves
+// entries of ids that add() hands out again. The last mapped segment is
+// rewritten in place without them, before any new image takes those ids.
+bool RegionIndex::dropUnlisted() {
+    string path = segments_.back()->path;
+    vector<IndexEntry> kept;
+    const Segment& segment = *segments_.back();
+    for (size_t i = 0; i < segment.count; i++) {
+        if (segment.entries[i].image < images_.size())
+            kept.push_back(segment.entries[i]);
+    }
+    segments_.pop_back(); // unmapped before it is replaced
+    return writeSegmentFile(path, kept);
+}
+
+bool RegionIndex::mapSegment(const string& path) {
+    unique_ptr<Segment> segment(new Segment());
+    segment->path = path;
+    if (!segment->file.openRead(path) || segment->file.size() < sizeof(SegmentHeader))
+        return false;
+    const SegmentHeader* header = (const SegmentHeader*)segment->file.data();
+    if (memcmp(header->magic, segmentMagic, sizeof(segmentMagic)) != 0
+        || segment->file.size() != sizeof(SegmentHeader) + header->count * sizeof(IndexEntry))
+        return false;
+    segment->entries = (const IndexEntry*)(segment->file.data() + sizeof(SegmentHeader));
+    segment->count = header->count;
+    segments_.push_back(move(segment));
+    return true;
+}
+
+size_t RegionIndex::entryCount() const {
+    size_t total = 0;
+    for (const auto& segment : segments_)
+        total += segment->count;
+    return total;
+}
+
+int RegionIndex::nextSegmentNumber() const {
+    int number = 0;
+    for (const auto& segment : segments_) {
+        string name = fs::path(segment->path).stem().string();
+        number = max(number, atoi(name.c_str() + 4) + 1);
+    }
+    return number;
+}
+
+bool RegionIndex::writeSegment(vector<IndexEntry>& entries) {
+    sort(entries.begin(), entries.end(), entryLess);
+    return writeSegmentFile((fs::path(dir_) / format("seg-%06d.bin", nextSegmentNumber())).string(), entries);
+}
+
+// Written under a temporary name and renamed, so readers never map a
+// partial segment. Entries must be sorted.
+bool RegionIndex::writeSegmentFile(const string& path, const vector<IndexEntry>& entries) {
+    string temp = path + ".tmp";
+    {
+        ofstream out(temp, ios::binary);
+        SegmentHeader header = {};
+        memcpy(header.magic, segmentMagic, sizeof(segmentMagic));
+        header.count = entries.size();
+        for (const IndexEntry& e : entries)
+            header.imageLimit = max(header.imageLimit, (uint64_t)e.image + 1);
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)entries.data(), entries.size() * sizeof(IndexEntry));
+        if (!out)
+            return false;
+    }
+    error_code ec;
+    fs::rename(temp, path, ec);
+    return !ec && mapSegment(path);
+}
+
+int RegionIndex::add(const string& path, const Mat& image) {
+    int id = (int)(images_.size() + pendingImages_.size());
+    int stepSize = params_.stepSize;
+    for (const BlockRecord& rec : firstBlockKeys(image, params_)) {
+        int col = rec.pos.x / stepSize, row = rec.pos.y / stepSize;
+        if (col > 0xffff || row > 0xffff)
+            continue; // beyond what an entry can address
+        pending_.push_back({ rec.key, (uint32_t)id, (uint16_t)col, (uint16_t)row });
+    }
+    pendingImages_.push_back({ path, image.size() });
+    if (pending_.size() >= flushEntries)
+        flush();
+    return id;
+}
+
+// The segment goes first, so a crash in between only loses the unlisted
+// images; open() removes their entries again
+bool RegionIndex::flush() {
+    if (pendingImages_.empty())
+        return true;
+    if (!pending_.empty() && !writeSegment(pending_))
+        return false;
+    ofstream list(fs::path(dir_) / "images.tsv", ios::app);
+    for (const ImageInfo& info : pendingImages_) {
+        list << images_.size() << "\t" << info.size.width << "\t" << info.size.height << "\t" << info.path << "\n";
+        images_.push_back(info);
+    }
+    pending_.clear();
+    pendingImages_.clear();
+    return (bool)list;
+}
+
+vector<IndexMatch> RegionIndex::query(const Mat& image, int minClusterSize, size_t maxHitsPerKey,
+                                      IndexQueryStats* stats) const {
+    IndexQueryStats st;
+    int64 t = getTickCount();
+    vector<BlockRecord> keys = firstBlockKeys(image, params_);
+    sort(keys.begin(), keys.end(), [](const BlockRecord& a, const BlockRecord& b) { return a.key < b.key; });
+    st.queryKeys = keys.size();
+    st.keyMs = elapsedMs(t);
+
+    // Keys ascend, so each segment's search resumes where the last one ended
+    t = getTickCount();
+    int stepSize = params_.stepSize;
+    vector<size_t> cursor(segments_.size(), 0);
+    vector<IndexEntry> hits;
+    unordered_map<uint32_t, vector<ClonePair>> pairs;
+    for (const BlockRecord& rec : keys) {
+        hits.clear();
+        for (size_t s = 0; s < segments_.size(); s++) {
+            const Segment& segment = *segments_[s];
+            const IndexEntry* begin = segment.entries + cursor[s];
+            const IndexEntry* end = segment.entries + segment.count;
+            const IndexEntry* it = lower_bound(begin, end, rec.key,
+                                               [](const IndexEntry& e, uint64_t key) { return e.key < key; });
+            for (; it != end && it->key == rec.key && hits.size() <= maxHitsPerKey; ++it)
+                hits.push_back(*it);
+            cursor[s] = it - segment.entries;
+        }
+        if (hits.size() > maxHitsPerKey) {
+            st.skippedKeys++;
+            continue;
+        }
+        for (const IndexEntry& hit : hits) {
+            if (hit.image >= images_.size())
+                continue;
+            pairs[hit.image].push_back({ Point(hit.col * stepSize, hit.row * stepSize), rec.pos });
+            st.hits++;
+        }
+    }
+    st.lookupMs = elapsedMs(t);
+
+    // Pairs in raster order of the query block, as clusterClones() sees them
+    // within one image
+    t = getTickCount();
+    vector<IndexMatch> matches;
+    for (auto& entry : pairs) {
+        vector<ClonePair>& list = entry.second;
+        sort(list.begin(), list.end(), [](const ClonePair& a, const ClonePair& b) {
+            return a.dst.y != b.dst.y ? a.dst.y < b.dst.y : a.dst.x < b.dst.x;
+        });
+        IndexMatch match;
+        match.clusters = clusterClones(list, minClusterSize, params_.directionTolerance);
+        if (match.clusters.empty())
+            continue;
+        match.image = (int)entry.first;
+        match.path = images_[entry.first].path;
+        match.pairs = list.size();
+        matches.push_back(move(match));
+    }
+    sort(matches.begin(), matches.end(), [](const IndexMatch& a, const IndexMatch& b) {
+        return a.pairs != b.pairs ? a.pairs > b.pairs : a.image < b.image;
+    });
+    st.clusterMs = elapsedMs(t);
+    if (stats)
+        *stats = st;
+    return matches;
+}
+
+bool RegionIndex::compact() {
+    if (!flush())
+        return false;
+    if (segments_.size() <= 1)
+        return true;
+
+    // k-way merge of the sorted segments
+    struct Cursor {
+        const IndexEntry* at;
+        const IndexEntry* end;
+    };
+    auto later = [](const Cursor& a, const Cursor& b) { return entryLess(*b.at, *a.at); };
+    priority_queue<Cursor, vector<Cursor>, decltype(later)> heads(later);
+    for (const auto& segment : segments_) {
+        if (segment->count > 0)
+            heads.push({ segment->entries, segment->entries + segment->count });
+    }
+
+    string path = (fs::path(dir_) / format("seg-%06d.bin", nextSegmentNumber())).string();
+    string temp = path + ".tmp";
+    {
+        ofstream out(temp, ios::binary);
+        SegmentHeader header = {};
+        memcpy(header.magic, segmentMagic, sizeof(segmentMagic));
+        header.count = entryCount();
+        header.imageLimit = images_.size();
+        out.write((const char*)&header, sizeof(header));
+        vector<IndexEntry> buffer;
+        buffer.reserve(1 << 16);
+        while (!heads.empty()) {
+            Cursor c = heads.top();
+            heads.pop();
+            buffer.push_back(*c.at);
+            if (++c.at != c.end)
+                heads.push(c);
+            if (buffer.size() == buffer.capacity() || heads.empty()) {
+                out.write((const char*)buffer.data(), buffer.size() * sizeof(IndexEntry));
+                buffer.clear();
+            }
+        }
+        if (!out)
+            return false;
+    }
+
+    // Old segments are removed only once the merged one is in place
+    vector<string> old;
+    for (const auto& segment : segments_)
+        old.push_back(segment->path);
+    error_code ec;
+    fs::rename(temp, path, ec);
+    if (ec)
+        return false;
+    segments_.clear();
+    for (const string& name : old)
+        fs::remove(name, ec);
+    return mapSegment(path);
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "clone_detector.h"
+#include "mapped_file.h"
+
+#include <opencv2/core.hpp>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// One indexed block: the first block of an image with this key. Positions
+// are in block steps, so 16-bit fields cover images up to 65535 steps wide.
+struct IndexEntry {
+    uint64_t key;
+    uint32_t image;
+    uint16_t col, row;
+};
+
+// Clusters of blocks in a query image whose keys also occur in an indexed
+// image. src is in the indexed image, dst in the query image.
+struct IndexMatch {
+    int image = -1;
+    std::string path;
+    size_t pairs = 0; // matched blocks before clustering
+    std::vector<std::vector<ClonePair>> clusters;
+};
+
+struct IndexQueryStats {
+    size_t queryKeys = 0;
+    size_t hits = 0;
+    size_t skippedKeys = 0; // keys in more than maxHitsPerKey indexed images
+    double keyMs = 0, lookupMs = 0, clusterMs = 0;
+};
+
+// Persistent index of block keys across many images, kept in a directory:
+//   index.cfg   block size, step and detail threshold, fixed at creation
+//   images.tsv  one line per image: id, width, height, path; append-only
+//   seg-N.bin   immutable segments of IndexEntry sorted by key, then image
+// Each add() writes new segments and appends to images.tsv, so nothing is
+// rewritten. Segments are memory-mapped on open and searched by binary
+// search, so opening costs nothing and a query costs a few probes per key
+// and segment. compact() merges all segments into one.
+class RegionIndex {
+public:
+    // Opens the index in dir. With create, a missing index is created with
+    // params' blockSize, stepSize and detailThreshold; an existing index
+    // keeps the values it was created with.
+    bool open(const std::string& dir, const CloneParams& params = CloneParams(), bool create = false);
+
+    const CloneParams& params() const { return params_; }
+    size_t imageCount() const { return images_.size(); }
+    const std::string& imagePath(int id) const { return images_[id].path; }
+    size_t entryCount() const;
+    size_t segmentCount() const { return segments_.size(); }
+
+    // Indexes images as BGR; returns their ids. Entries are buffered and
+    // written as a segment every flushEntries entries and at the end.
+    int add(const std::string& path, const cv::Mat& image);
+    bool flush();
+
+    // Matches the query image's blocks against every indexed image, clusters
+    // the pairs of each image by displacement and returns the images with a
+    // cluster of at least minClusterSize pairs, most pairs first. Keys found
+    // in more than maxHitsPerKey images are flat or common texture and are
+    // skipped.
+    std::vector<IndexMatch> query(const cv::Mat& image, int minClusterSize = 3, size_t maxHitsPerKey = 64,
+                                  IndexQueryStats* stats = nullptr) const;
+
+    // Merges all segments into one
+    bool compact();
+
+    size_t flushEntries = (size_t)1 << 24;
+
+private:
+    struct ImageInfo {
+        std::string path;
+        cv::Size size;
+    };
+    struct Segment {
+        std::string path;
+        MappedFile file;
+        const IndexEntry* entries = nullptr;
+        size_t count = 0;
+    };
+
+    bool mapSegment(const std::string& path);
+    static size_t imageLimit(const Segment& segment);
+    bool dropUnlisted();
+    bool writeSegment(std::vector<IndexEntry>& entries);
+    bool writeSegmentFile(const std::string& path, const std::vector<IndexEntry>& entries);
+    int nextSegmentNumber() const;
+
+    std::string dir_;
+    CloneParams params_;
+    std::vector<ImageInfo> images_;
+    std::vector<std::unique_ptr<Segment>> segments_;
+    std::vector<IndexEntry> pending_;
+    std::vector<ImageInfo> pendingImages_;
+};
+
+// The first block of every key in the image, in raster order, with the keys
+// and detail filter of CloneDetector's hash engine
+std::vector<BlockRecord> firstBlockKeys(const cv::Mat& image, const CloneParams& params);
@@ -0,0 +1,91 @@
+#include "report_json.h"
+
+using namespace cv;
+using namespace std;
+
+string imageStem(const string& path) {
+    size_t slash = path.find_last_of("/\\");
+    string name = (slash == string::npos) ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return (dot == string::npos || dot == 0) ? name : name.substr(0, dot);
+}
+
+string jsonEscape(const string& text) {
+    string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        if ((unsigned char)c < 0x20) {
+            out += format("\\u%04x", c);
+            continue;
+        }
+        out += c;
+    }
+    return out;
+}
+
+void writeStats(ostream& out, const CloneStats& st) {
+    out << "{\"blocksVisited\": " << st.blocksVisited
+        << ", \"blocksFiltered\": " << st.blocksFiltered
+        << ", \"uniqueKeys\": " << st.uniqueKeys
+        << ", \"keyCollisions\": " << st.keyCollisions
+        << ", \"probeCollisions\": " << st.probeCollisions
+        << ", \"rejectedByDistance\": " << st.rejectedByDistance
+        << ", \"candidatePairs\": " << st.candidatePairs
+        << ", \"clustersKept\": " << st.clustersKept
+        << ", \"stageMs\": {\"pyramid\": " << st.pyramidMs << ", \"detail\": " << st.detailMs
+        << ", \"keyMap\": " << st.keyMapMs << ", \"scan\": " << st.scanMs
+        << ", \"match\": " << st.matchMs << ", \"cluster\": " << st.clusterMs << "}}";
+}
+
+void writeClusters(ostream& out, const vector<vector<ClonePair>>& clusters, const string& indent) {
+    out << "[";
+    for (size_t c = 0; c < clusters.size(); c++) {
+        Point d = clusters[c][0].displacement();
+        out << (c ? ",\n" : "\n")
+            << indent << "  {\"displacement\": [" << d.x << ", " << d.y << "], \"pairs\": [";
+        for (size_t i = 0; i < clusters[c].size(); i++) {
+            const ClonePair& p = clusters[c][i];
+            out << (i ? ", " : "") << "[" << p.src.x << ", " << p.src.y << ", "
+                << p.dst.x << ", " << p.dst.y << "]";
+        }
+        out << "]}";
+    }
+    out << (clusters.empty() ? "]" : "\n" + indent + "]");
+}
+
+static const char* engineName(int engine) {
+    switch (engine) {
+    case ENGINE_DCT: return "dct";
+    case ENGINE_KEYPOINT: return "keypoint";
+    default: return "hash";
+    }
+}
+
+void writeParams(ostream& out, const CloneParams& params) {
+    out << "{\"blockSize\": " << params.blockSize
+        << ", \"stepSize\": " << params.stepSize
+        << ", \"detailThreshold\": " << params.detailThreshold
+        << ", \"minDistance\": " << params.minDistance
+        << ", \"engine\": \"" << engineName(params.matchEngine) << "\""
+        << ", \"matchAll\": " << (params.matchMode == MATCH_ALL ? "true" : "false")
+        << ", \"maxOccurrences\": " << params.maxOccurrences
+        << ", \"pyramidLevels\": " << params.pyramidLevels
+        << ", \"minClusterSize\": " << params.minClusterSize
+        << ", \"directionTolerance\": " << params.directionTolerance
+        << ", \"mergeReversed\": " << (params.mergeReversed ? "true" : "false")
+        << ", \"detailEngine\": \"" << (params.detailEngine == DETAIL_PER_BLOCK ? "perBlock" : "integral") << "\"";
+    if (params.matchEngine == ENGINE_HASH)
+        out << ", \"keyEngine\": \"" << (params.keyEngine == KEY_PER_BLOCK ? "perBlock" : "sampleMap") << "\""
+            << ", \"keyMatcher\": \"" << (params.keyMatcher == MATCHER_RADIX_SORT ? "radix" : "table") << "\"";
+    if (params.matchEngine == ENGINE_DCT)
+        out << ", \"dctCoefficients\": " << params.dctCoefficients
+            << ", \"dctQuantStep\": " << params.dctQuantStep
+            << ", \"dctWindow\": " << params.dctWindow
+            << ", \"dctTolerance\": " << params.dctTolerance;
+    if (params.matchEngine == ENGINE_KEYPOINT)
+        out << ", \"keypoints\": \"" << (params.keypointType == KEYPOINT_SIFT ? "sift" : "orb") << "\""
+            << ", \"maxKeypoints\": " << params.maxKeypoints
+            << ", \"g2nnRatio\": " << params.g2nnRatio
+            << ", \"clusterRadius\": " << params.clusterRadius;
+    out << "}";
+}
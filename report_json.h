@@ -0,0 +1,25 @@
+#pragma once
+
+#include "clone_detector.h"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+// JSON fragments shared by the command-line tools' reports
+
+// File name without directory and extension
+std::string imageStem(const std::string& path);
+
+std::string jsonEscape(const std::string& text);
+
+// One-line JSON object, so records on stdout can be collected line by line
+void writeStats(std::ostream& out, const CloneStats& st);
+
+// The array only; items are indented one level deeper than indent
+void writeClusters(std::ostream& out, const std::vector<std::vector<ClonePair>>& clusters,
+                   const std::string& indent);
+
+// Every setting that can change the result, so a report can be rerun; those
+// of other engines than params.matchEngine are left out
+void writeParams(std::ostream& out, const CloneParams& params);
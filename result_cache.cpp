@@ -0,0 +1,272 @@
+#include "result_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+using namespace cv;
+using namespace std;
+namespace fs = std::filesystem;
+
+static const char resultMagic[8] = {'I', 'A', 'R', 'E', 'S', 'L', 'T', '1'};
+
+static uint64_t textHash(const string& text) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : text) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Eight bytes per step; the tail is folded in byte by byte
+static uint64_t bytesHash(const uchar* data, size_t n, uint64_t seed) {
+    uint64_t h = BlockTable::mix(seed + 0x9e3779b97f4a7c15ULL);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    for (; i < n; i++)
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    return BlockTable::mix(h ^ n);
+}
+
+// Rows are hashed in parallel and combined in order
+uint64_t ResultCache::imageHash(const Mat& image) {
+    vector<uint64_t> rows(image.rows);
+    size_t rowBytes = (size_t)image.cols * image.elemSize();
+    parallel_for_(Range(0, image.rows), [&](const Range& r) {
+        for (int y = r.start; y < r.end; y++)
+            rows[y] = bytesHash(image.ptr(y), rowBytes, y);
+    });
+    int header[3] = { image.cols, image.rows, image.type() };
+    uint64_t h = bytesHash((const uchar*)header, sizeof(header), 0);
+    return bytesHash((const uchar*)rows.data(), rows.size() * sizeof(uint64_t), h);
+}
+
+string ResultCache::paramsKey(const CloneParams& p) {
+    return format("block=%d step=%d detail=%.17g mindist=%d match=%d maxocc=%d matcher=%d pyramid=%d "
+                  "cluster=%d tol=%.17g reversed=%d detailengine=%d keyengine=%d engine=%d "
+                  "dctcoef=%d dctquant=%.17g dctwindow=%d dcttol=%d kp=%d maxkp=%d g2nn=%.17g radius=%.17g",
+                  p.blockSize, p.stepSize, p.detailThreshold, p.minDistance, p.matchMode, p.maxOccurrences,
+                  p.keyMatcher, p.pyramidLevels, p.minClusterSize, p.directionTolerance, (int)p.mergeReversed,
+                  p.detailEngine, p.keyEngine, p.matchEngine, p.dctCoefficients, p.dctQuantStep, p.dctWindow,
+                  p.dctTolerance, p.keypointType, p.maxKeypoints, p.g2nnRatio, p.clusterRadius);
+}
+
+bool ResultCache::open(const string& dir, size_t maxBytes) {
+    error_code ec;
+    fs::create_directories(dir, ec);
+    if (!fs::is_directory(dir, ec)) {
+        dir_.clear();
+        return false;
+    }
+    dir_ = dir;
+    maxBytes_ = maxBytes;
+    return true;
+}
+
+string ResultCache::resultPath(uint64_t imageHash, const string& key) const {
+    return (fs::path(dir_) / format("res-%016llx-%016llx.bin", (unsigned long long)imageHash,
+                                    (unsigned long long)textHash(key))).string();
+}
+
+string ResultCache::sourcePath(const string& absolutePath) const {
+    return (fs::path(dir_) / format("src-%016llx.txt", (unsigned long long)textHash(absolutePath))).string();
+}
+
+template <typename T>
+static void put(vector<char>& out, const T& value) {
+    const char* p = (const char*)&value;
+    out.insert(out.end(), p, p + sizeof(T));
+}
+
+static void putPairs(vector<char>& out, const vector<ClonePair>& pairs) {
+    put(out, (uint64_t)pairs.size());
+    for (const ClonePair& pair : pairs) {
+        int32_t v[4] = { pair.src.x, pair.src.y, pair.dst.x, pair.dst.y };
+        put(out, v);
+    }
+}
+
+// Bounds-checked reads over a loaded file
+struct Reader {
+    const char* at;
+    const char* end;
+
+    template <typename T>
+    bool get(T& value) {
+        if ((size_t)(end - at) < sizeof(T))
+            return false;
+        memcpy(&value, at, sizeof(T));
+        at += sizeof(T);
+        return true;
+    }
+
+    bool getPairs(vector<ClonePair>& pairs) {
+        uint64_t n;
+        if (!get(n) || n > (uint64_t)(end - at) / 16)
+            return false;
+        pairs.resize(n);
+        for (ClonePair& pair : pairs) {
+            int32_t v[4];
+            get(v);
+            pair.src = Point(v[0], v[1]);
+            pair.dst = Point(v[2], v[3]);
+        }
+        return true;
+    }
+};
+
+// The full parameter text is stored and compared, so a params hash collision
+// is a miss rather than a wrong result
+bool ResultCache::load(uint64_t imageHash, const CloneParams& params, CloneResult& result) {
+    if (!isOpen())
+        return false;
+    string key = paramsKey(params);
+    string path = resultPath(imageHash, key);
+    ifstream in(path, ios::binary);
+    vector<char> data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    Reader r = { data.data(), data.data() + data.size() };
+
+    char magic[8];
+    uint32_t keyBytes = 0, statsBytes = 0;
+    uint64_t stored = 0, clusterCount = 0;
+    CloneResult loaded;
+    bool ok = r.get(magic) && memcmp(magic, resultMagic, sizeof(magic)) == 0
+           && r.get(stored) && stored == imageHash
+           && r.get(keyBytes) && keyBytes == key.size() && (size_t)(r.end - r.at) >= keyBytes
+           && memcmp(r.at, key.data(), keyBytes) == 0;
+    if (ok) {
+        r.at += keyBytes;
+        ok = r.get(loaded.blockSize) && r.get(statsBytes) && statsBytes == sizeof(CloneStats)
+          && r.get(loaded.stats) && r.getPairs(loaded.candidatePairs) && r.get(clusterCount)
+          && clusterCount <= (uint64_t)(r.end - r.at) / 8;
+    }
+    if (ok) {
+        loaded.clusters.resize(clusterCount);
+        for (auto& cluster : loaded.clusters)
+            ok = ok && r.getPairs(cluster);
+    }
+    if (!ok) {
+        misses++;
+        return false;
+    }
+    result = move(loaded);
+    hits++;
+    error_code ec;
+    fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+    return true;
+}
+
+bool ResultCache::store(uint64_t imageHash, const CloneParams& params, const CloneResult& result) {
+    if (!isOpen())
+        return false;
+    string key = paramsKey(params);
+    vector<char> data;
+    data.insert(data.end(), resultMagic, resultMagic + sizeof(resultMagic));
+    put(data, imageHash);
+    put(data, (uint32_t)key.size());
+    data.insert(data.end(), key.begin(), key.end());
+    put(data, (int32_t)result.blockSize);
+    put(data, (uint32_t)sizeof(CloneStats));
+    put(data, result.stats);
+    putPairs(data, result.candidatePairs);
+    put(data, (uint64_t)result.clusters.size());
+    for (const auto& cluster : result.clusters)
+        putPairs(data, cluster);
+
+    // Renamed into place, so concurrent readers never see a partial file
+    string path = resultPath(imageHash, key);
+    string temp = path + format(".%llx.tmp", (unsigned long long)getTickCount());
+    {
+        ofstream out(temp, ios::binary);
+        out.write(data.data(), data.size());
+        if (!out)
+            return false;
+    }
+    error_code ec;
+    fs::rename(temp, path, ec);
+    if (ec) {
+        fs::remove(temp, ec);
+        return false;
+    }
+    evict();
+    return true;
+}
+
+// Oldest mtime first, until the directory fits the limit
+void ResultCache::evict() {
+    struct Entry {
+        fs::path path;
+        fs::file_time_type time;
+        uintmax_t bytes;
+    };
+    vector<Entry> entries;
+    uintmax_t total = 0;
+    error_code ec;
+    for (const auto& file : fs::directory_iterator(dir_, ec)) {
+        string name = file.path().filename().string();
+        if (name.compare(0, 4, "res-") != 0 && name.compare(0, 4, "src-") != 0)
+            continue;
+        Entry entry = { file.path(), file.last_write_time(ec), file.file_size(ec) };
+        if (ec)
+            continue;
+        total += entry.bytes;
+        entries.push_back(entry);
+    }
+    if (total <= maxBytes_)
+        return;
+    sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.time < b.time; });
+    for (const Entry& entry : entries) {
+        if (total <= maxBytes_)
+            break;
+        if (fs::remove(entry.path, ec))
+            total -= entry.bytes;
+    }
+}
+
+bool ResultCache::lookupSource(const string& path, uint64_t& imageHash, Size& size) {
+    if (!isOpen())
+        return false;
+    error_code ec;
+    fs::path source = fs::absolute(path, ec);
+    uintmax_t bytes = ec ? 0 : fs::file_size(source, ec);
+    long long time = ec ? 0 : (long long)fs::last_write_time(source, ec).time_since_epoch().count();
+    if (ec)
+        return false;
+
+    ifstream in(sourcePath(source.string()));
+    uintmax_t storedBytes;
+    long long storedTime;
+    unsigned long long hash;
+    string storedPath;
+    if (!(in >> storedBytes >> storedTime >> hex >> hash >> dec >> size.width >> size.height))
+        return false;
+    in.get();
+    getline(in, storedPath);
+    if (storedBytes != bytes || storedTime != time || storedPath != source.string())
+        return false;
+    imageHash = hash;
+    return true;
+}
+
+void ResultCache::rememberSource(const string& path, uint64_t imageHash, Size size) {
+    if (!isOpen())
+        return;
+    error_code ec;
+    fs::path source = fs::absolute(path, ec);
+    uintmax_t bytes = ec ? 0 : fs::file_size(source, ec);
+    long long time = ec ? 0 : (long long)fs::last_write_time(source, ec).time_since_epoch().count();
+    if (ec)
+        return;
+    ofstream out(sourcePath(source.string()));
+    out << bytes << " " << time << " " << hex << (unsigned long long)imageHash << dec << " "
+        << size.width << " " << size.height << " " << source.string() << "\n";
+}
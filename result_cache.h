@@ -0,0 +1,42 @@
+#pragma once
+
+#include "clone_detector.h"
+
+#include <opencv2/core.hpp>
+#include <cstdint>
+#include <string>
+
+// On-disk cache of detection results, one file per image and parameter set:
+//   res-<image hash>-<params hash>.bin  pairs, clusters and stats
+//   src-<path hash>.txt                 size and mtime of a source file and
+//                                       the hash of its pixels
+// The image hash covers the decoded pixels, so a renamed or re-encoded copy
+// of an image still hits. A hit touches the file's mtime, and store() evicts
+// the least recently used files until the directory fits maxBytes.
+class ResultCache {
+public:
+    bool open(const std::string& dir, size_t maxBytes = (size_t)1 << 30);
+    bool isOpen() const { return !dir_.empty(); }
+
+    static uint64_t imageHash(const cv::Mat& image);
+    // Every setting that can change the result, as text; not threads
+    static std::string paramsKey(const CloneParams& params);
+
+    bool load(uint64_t imageHash, const CloneParams& params, CloneResult& result);
+    bool store(uint64_t imageHash, const CloneParams& params, const CloneResult& result);
+
+    // Maps a file to the hash and size of its pixels as long as its size and
+    // mtime are unchanged, so a hit can skip decoding it
+    bool lookupSource(const std::string& path, uint64_t& imageHash, cv::Size& size);
+    void rememberSource(const std::string& path, uint64_t imageHash, cv::Size size);
+
+    size_t hits = 0, misses = 0;
+
+private:
+    std::string resultPath(uint64_t imageHash, const std::string& key) const;
+    std::string sourcePath(const std::string& absolutePath) const;
+    void evict();
+
+    std::string dir_;
+    size_t maxBytes_ = 0;
+};
@@ -0,0 +1,237 @@
+#include "strip_reader.h"
+
+#include <opencv2/imgcodecs.hpp>
+#include <fstream>
+#include <vector>
+#include <cctype>
+#include <climits>
+#include <cstring>
+#ifdef HAVE_LIBTIFF
+#include <tiffio.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+class PnmStripReader : public StripReader {
+public:
+    PnmStripReader(ifstream&& in, Size size, int channels)
+        : in_(move(in)), size_(size), channels_(channels), row_(size.width * channels) {}
+
+    Size size() const override { return size_; }
+    bool streams() const override { return true; }
+
+    int read(Mat& out) override {
+        int n = min(out.rows, size_.height - nextRow_);
+        for (int r = 0; r < n; r++) {
+            if (!in_.read((char*)row_.data(), row_.size()))
+                return r; // truncated file
+            uchar* dst = out.ptr<uchar>(r);
+            for (int x = 0; x < size_.width; x++) {
+                const uchar* src = &row_[x * channels_];
+                if (channels_ == 1) {
+                    dst[3 * x] = dst[3 * x + 1] = dst[3 * x + 2] = src[0];
+                } else {
+                    dst[3 * x] = src[2]; // RGB on disk, BGR in memory
+                    dst[3 * x + 1] = src[1];
+                    dst[3 * x + 2] = src[0];
+                }
+            }
+            nextRow_++;
+        }
+        return n;
+    }
+
+private:
+    ifstream in_;
+    Size size_;
+    int channels_;
+    int nextRow_ = 0;
+    vector<uchar> row_;
+};
+
+class WholeImageReader : public StripReader {
+public:
+    explicit WholeImageReader(const Mat& image) : image_(image) {}
+
+    Size size() const override { return image_.size(); }
+    bool streams() const override { return false; }
+
+    int read(Mat& out) override {
+        int n = min(out.rows, image_.rows - nextRow_);
+        image_.rowRange(nextRow_, nextRow_ + n).copyTo(out.rowRange(0, n));
+        nextRow_ += n;
+        return n;
+    }
+
+private:
+    Mat image_;
+    int nextRow_ = 0;
+};
+
+// Next header number, skipping whitespace and # comments
+static bool readPnmNumber(istream& in, long long& value) {
+    int c = in.get();
+    while (c != EOF && (isspace(c) || c == '#')) {
+        if (c == '#') {
+            while (c != EOF && c != '\n') c = in.get();
+        }
+        c = in.get();
+    }
+    if (c == EOF || !isdigit(c))
+        return false;
+    value = 0;
+    while (c != EOF && isdigit(c)) {
+        value = value * 10 + (c - '0');
+        c = in.get();
+    }
+    // c is the single whitespace byte that ends the header field
+    return c != EOF && isspace(c);
+}
+
+static unique_ptr<StripReader> openPnm(const string& path) {
+    ifstream in(path, ios::binary);
+    char magic[2];
+    if (!in.read(magic, 2) || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6'))
+        return nullptr;
+    long long width, height, maxval;
+    if (!readPnmNumber(in, width) || !readPnmNumber(in, height) || !readPnmNumber(in, maxval))
+        return nullptr;
+    // imread rescales other ranges; leave those to it
+    if (width <= 0 || height <= 0 || width > INT_MAX / 3 || height > INT_MAX || maxval != 255)
+        return nullptr;
+    int channels = (magic[1] == '6') ? 3 : 1;
+    return unique_ptr<StripReader>(new PnmStripReader(move(in), Size((int)width, (int)height), channels));
+}
+
+#ifdef HAVE_LIBTIFF
+class TiffStripReader : public StripReader {
+public:
+    TiffStripReader(TIFF* tif, Size size, int samples, int tileWidth, int tileHeight)
+        : tif_(tif), size_(size), samples_(samples), tileWidth_(tileWidth), tileHeight_(tileHeight) {
+        if (tileHeight_ > 0) {
+            tile_.resize(TIFFTileSize(tif_));
+            row_.resize((size_t)tileHeight_ * size_.width * samples_);
+        } else {
+            row_.resize(TIFFScanlineSize(tif_));
+        }
+    }
+    ~TiffStripReader() override { TIFFClose(tif_); }
+
+    Size size() const override { return size_; }
+    bool streams() const override { return true; }
+
+    int read(Mat& out) override {
+        int n = min(out.rows, size_.height - nextRow_);
+        for (int r = 0; r < n; r++) {
+            const uchar* row = nextRow();
+            if (!row)
+                return r; // damaged file
+            uchar* dst = out.ptr<uchar>(r);
+            for (int x = 0; x < size_.width; x++) {
+                const uchar* src = row + x * samples_;
+                if (samples_ < 3) {
+                    dst[3 * x] = dst[3 * x + 1] = dst[3 * x + 2] = src[0];
+                } else {
+                    dst[3 * x] = src[2]; // alpha, if any, is dropped as imread does
+                    dst[3 * x + 1] = src[1];
+                    dst[3 * x + 2] = src[0];
+                }
+            }
+            nextRow_++;
+        }
+        return n;
+    }
+
+private:
+    // Row nextRow_ of the image, or null on a read error. Tiled files are
+    // decoded one row of tiles at a time.
+    const uchar* nextRow() {
+        if (tileHeight_ == 0)
+            return TIFFReadScanline(tif_, row_.data(), nextRow_, 0) < 0 ? nullptr : row_.data();
+        int tileRow = nextRow_ % tileHeight_;
+        if (tileRow == 0) {
+            int rows = min(tileHeight_, size_.height - nextRow_);
+            for (int x = 0; x < size_.width; x += tileWidth_) {
+                if (TIFFReadTile(tif_, tile_.data(), x, nextRow_, 0, 0) < 0)
+                    return nullptr;
+                size_t bytes = (size_t)min(tileWidth_, size_.width - x) * samples_;
+                for (int y = 0; y < rows; y++)
+                    memcpy(&row_[((size_t)y * size_.width + x) * samples_],
+                           &tile_[(size_t)y * tileWidth_ * samples_], bytes);
+            }
+        }
+        return &row_[(size_t)tileRow * size_.width * samples_];
+    }
+
+    TIFF* tif_;
+    Size size_;
+    int samples_;
+    int tileWidth_, tileHeight_; // 0 for files stored in strips
+    int nextRow_ = 0;
+    vector<uchar> row_;          // one scanline, or one row of tiles
+    vector<uchar> tile_;
+};
+
+// Plain 8-bit gray or RGB in one plane, stored top to bottom; JPEG-compressed
+// YCbCr is converted to RGB by libtiff. Anything else is left to imread.
+static unique_ptr<StripReader> openTiff(const string& path) {
+    // Checked first, so libtiff reports no errors for JPEG or PNG files
+    char magic[4] = {};
+    ifstream(path, ios::binary).read(magic, 4);
+    bool little = magic[0] == 'I' && magic[1] == 'I' && (magic[2] == 42 || magic[2] == 43) && magic[3] == 0;
+    bool big = magic[0] == 'M' && magic[1] == 'M' && magic[2] == 0 && (magic[3] == 42 || magic[3] == 43);
+    if (!little && !big)
+        return nullptr;
+    TIFF* tif = TIFFOpen(path.c_str(), "r");
+    if (!tif)
+        return nullptr;
+    uint32_t width = 0, height = 0;
+    uint16_t bits = 0, samples = 0, planar = 0, format = 0, orientation = 0, photometric = 0, compression = 0;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &format);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_ORIENTATION, &orientation);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression);
+    TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+    if (compression == COMPRESSION_JPEG && photometric == PHOTOMETRIC_YCBCR) {
+        TIFFSetField(tif, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+        photometric = PHOTOMETRIC_RGB;
+    }
+    bool gray = photometric == PHOTOMETRIC_MINISBLACK && samples >= 1 && samples <= 2;
+    bool rgb = photometric == PHOTOMETRIC_RGB && samples >= 3 && samples <= 4;
+    uint32_t tileWidth = 0, tileHeight = 0;
+    if (TIFFIsTiled(tif)) {
+        TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tileWidth);
+        TIFFGetField(tif, TIFFTAG_TILELENGTH, &tileHeight);
+    }
+    bool tilesOk = !TIFFIsTiled(tif) || (tileWidth > 0 && tileHeight > 0 && tileWidth <= (uint32_t)INT_MAX
+                                          && tileHeight <= (uint32_t)INT_MAX);
+    if (width == 0 || height == 0 || width > INT_MAX / 4 || height > INT_MAX || bits != 8
+        || planar != PLANARCONFIG_CONTIG || format != SAMPLEFORMAT_UINT || orientation != ORIENTATION_TOPLEFT
+        || !(gray || rgb) || !tilesOk) {
+        TIFFClose(tif);
+        return nullptr;
+    }
+    return unique_ptr<StripReader>(new TiffStripReader(tif, Size((int)width, (int)height), samples,
+                                                       (int)tileWidth, (int)tileHeight));
+}
+#endif
+
+unique_ptr<StripReader> openStripReader(const string& path) {
+    unique_ptr<StripReader> reader = openPnm(path);
+    if (reader)
+        return reader;
+#ifdef HAVE_LIBTIFF
+    reader = openTiff(path);
+    if (reader)
+        return reader;
+#endif
+    Mat image = imread(path, IMREAD_COLOR);
+    if (image.empty())
+        return nullptr;
+    return unique_ptr<StripReader>(new WholeImageReader(image));
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <memory>
+#include <string>
+
+// An image decoded top to bottom a few rows at a time
+class StripReader {
+public:
+    virtual ~StripReader() {}
+    virtual cv::Size size() const = 0;
+    // Fills the rows of a CV_8UC3 buffer with the next rows of the image, as
+    // imread(IMREAD_COLOR) would decode them. Returns the number of rows read,
+    // less than out.rows only at the end of the image.
+    virtual int read(cv::Mat& out) = 0;
+    // False if the whole image was decoded up front, so memory is not bounded
+    virtual bool streams() const = 0;
+};
+
+// Binary PGM/PPM files with 8-bit samples, and in builds with libtiff, 8-bit
+// gray or RGB TIFF files, are decoded incrementally, so only the requested
+// rows (for tiled TIFFs, one row of tiles) are ever in memory. Any other
+// format is loaded whole with imread. Returns null if the file cannot be read.
+std::unique_ptr<StripReader> openStripReader(const std::string& path);
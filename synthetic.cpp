@@ -0,0 +1,78 @@
+#include "synthetic.h"
+
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace cv;
+using namespace std;
+
+SyntheticForgery makeSyntheticForgery(Size size, int regions, uint64_t seed, const ForgeryOptions& options) {
+    RNG rng(seed);
+    SyntheticForgery out;
+
+    // Smooth colour field, random shapes for edges, then sensor-like noise
+    Mat coarse(max(2, size.height / 32), max(2, size.width / 32), CV_8UC3);
+    rng.fill(coarse, RNG::UNIFORM, Scalar::all(0), Scalar::all(256));
+    resize(coarse, out.image, size, 0, 0, INTER_CUBIC);
+
+    int shapes = max(8, (int)(size.area() / 20000));
+    for (int i = 0; i < shapes; i++) {
+        Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+        int radius = rng.uniform(2, max(3, min(size.width, size.height) / 20));
+        Scalar color(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+        if (i % 2)
+            circle(out.image, center, radius, color, FILLED);
+        else
+            rectangle(out.image, Rect(center.x, center.y, radius, radius / 2 + 1), color, FILLED);
+    }
+
+    Mat noise(size, CV_8UC3);
+    rng.fill(noise, RNG::NORMAL, Scalar::all(128), Scalar::all(6));
+    addWeighted(out.image, 1.0, noise, 1.0, -128.0, out.image);
+
+    // Each region is copied once, to a spot that overlaps neither itself nor
+    // earlier regions
+    out.mask = Mat::zeros(size, CV_8U);
+    int side = max(16, min(size.width, size.height) / 10);
+    int copySide = max(1, (int)lround(side * options.copyScale));
+    if (max(side, copySide) * 2 > min(size.width, size.height))
+        return out;
+    for (int r = 0; r < regions; r++) {
+        for (int attempt = 0; attempt < 100; attempt++) {
+            Rect src(rng.uniform(0, size.width - side), rng.uniform(0, size.height - side), side, side);
+            Rect dst(rng.uniform(0, size.width - copySide), rng.uniform(0, size.height - copySide),
+                     copySide, copySide);
+            if ((src & dst).area() > 0 || countNonZero(out.mask(src)) || countNonZero(out.mask(dst)))
+                continue;
+            Mat copy = out.image(src).clone();
+            if (copySide != side)
+                resize(copy, copy, dst.size(), 0, 0, INTER_LINEAR);
+            if (options.copyBrightness != 0)
+                copy.convertTo(copy, -1, 1.0, options.copyBrightness);
+            copy.copyTo(out.image(dst));
+            out.mask(src).setTo(255);
+            out.mask(dst).setTo(255);
+            break;
+        }
+    }
+
+    // A separate generator, so the options never change the base image
+    RNG post(seed ^ 0x5bd1e995ULL);
+    if (options.noiseSigma > 0) {
+        Mat extra(size, CV_16SC3);
+        post.fill(extra, RNG::NORMAL, Scalar::all(0), Scalar::all(options.noiseSigma));
+        Mat noisy;
+        out.image.convertTo(noisy, CV_16SC3);
+        add(noisy, extra, noisy);
+        noisy.convertTo(out.image, CV_8UC3);
+    }
+    if (options.jpegQuality > 0) {
+        vector<uchar> encoded;
+        imencode(".jpg", out.image, encoded, { IMWRITE_JPEG_QUALITY, options.jpegQuality });
+        out.image = imdecode(encoded, IMREAD_COLOR);
+    }
+    return out;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <cstdint>
+
+// Textured test image with copy-move regions planted at known places
+struct SyntheticForgery {
+    cv::Mat image;
+    cv::Mat mask; // 255 on every planted source and copy
+};
+
+// What happens to a forgery on its way out of an editor. The copy options
+// change each pasted copy; noise and JPEG apply to the whole image after.
+struct ForgeryOptions {
+    double copyScale = 1.0;      // copies are resized by this; their mask too
+    double copyBrightness = 0;   // gray levels added to each copy
+    double noiseSigma = 0;       // Gaussian noise over the whole image
+    int jpegQuality = 0;         // re-encoded as JPEG at this quality, 0 = not
+};
+
+// Deterministic for a given size, region count, seed and options. Default
+// options give the same image as before they existed.
+SyntheticForgery makeSyntheticForgery(cv::Size size, int regions, uint64_t seed,
+                                      const ForgeryOptions& options = ForgeryOptions());
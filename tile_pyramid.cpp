@@ -0,0 +1,288 @@
+#include "tile_pyramid.h"
+#include "strip_reader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+
+using namespace cv;
+using namespace std;
+namespace fs = std::filesystem;
+
+// First page of the cache file; tiles start at headerBytes
+struct CacheHeader {
+    char magic[8];
+    uint64_t sourceBytes;
+    int64_t sourceTime;
+    int32_t width, height;
+    int32_t tileSize;
+    int32_t complete; // set last, so an interrupted build is rebuilt
+    uint64_t fileSize;
+};
+
+static const char cacheMagic[8] = {'I', 'A', 'T', 'I', 'L', 'E', 'S', '1'};
+static const size_t headerBytes = 4096;
+static const size_t tileBytes = (size_t)TilePyramid::tileSize * TilePyramid::tileSize * 3;
+
+// FNV-1a, so the cache name of a path is the same in every build
+static uint64_t pathHash(const string& text) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : text) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+size_t TilePyramid::layout(Size imageSize) {
+    levels_.clear();
+    size_t offset = headerBytes;
+    Size size = imageSize;
+    while (true) {
+        Level level;
+        level.size = size;
+        level.tilesX = (size.width + tileSize - 1) / tileSize;
+        level.tilesY = (size.height + tileSize - 1) / tileSize;
+        level.offset = offset;
+        offset += (size_t)level.tilesX * level.tilesY * tileBytes;
+        levels_.push_back(level);
+        if (size.width <= tileSize && size.height <= tileSize)
+            break;
+        size = Size((size.width + 1) / 2, (size.height + 1) / 2);
+    }
+    return offset;
+}
+
+uchar* TilePyramid::tileData(int level, int tx, int ty) const {
+    const Level& lv = levels_[level];
+    return file_.data() + lv.offset + ((size_t)ty * lv.tilesX + tx) * tileBytes;
+}
+
+void TilePyramid::setCacheDir(const string& dir, size_t maxBytes) {
+    cacheDir_ = dir;
+    maxCacheBytes_ = maxBytes;
+}
+
+void TilePyramid::close() {
+    file_.close();
+    levels_.clear();
+    recent_.clear();
+    tiles_.clear();
+    if (cacheDir_.empty() && !cachePath_.empty()) {
+        error_code ec;
+        fs::remove(cachePath_, ec);
+    }
+    cachePath_.clear();
+}
+
+bool TilePyramid::open(const string& imagePath, size_t cacheTiles) {
+    close();
+    cacheTiles_ = max(cacheTiles, (size_t)1);
+
+    error_code ec;
+    fs::path source = fs::absolute(imagePath, ec);
+    uint64_t sourceBytes = ec ? 0 : fs::file_size(source, ec);
+    int64_t sourceTime = ec ? 0 : (int64_t)fs::last_write_time(source, ec).time_since_epoch().count();
+    if (ec)
+        return false;
+    fs::path dir = cacheDir_.empty() ? fs::temp_directory_path(ec) : fs::path(cacheDir_);
+    if (!cacheDir_.empty())
+        fs::create_directories(dir, ec);
+    if (ec)
+        return false;
+    cachePath_ = (dir / format("image_tiles_%016llx.bin", (unsigned long long)pathHash(source.string()))).string();
+
+    if (file_.openRead(cachePath_) && file_.size() >= headerBytes) {
+        const CacheHeader* header = (const CacheHeader*)file_.data();
+        if (memcmp(header->magic, cacheMagic, sizeof(cacheMagic)) == 0 && header->complete == 1 &&
+            header->tileSize == tileSize && header->sourceBytes == sourceBytes &&
+            header->sourceTime == sourceTime && header->width > 0 && header->height > 0 &&
+            header->fileSize == file_.size() && layout(Size(header->width, header->height)) == file_.size()) {
+            fs::last_write_time(cachePath_, fs::file_time_type::clock::now(), ec); // recently used
+            return true;
+        }
+        levels_.clear();
+    }
+    file_.close();
+
+    bool built = build(imagePath, sourceBytes, sourceTime);
+    file_.close();
+    if (!built || !file_.openRead(cachePath_)) {
+        close();
+        return false;
+    }
+    evict();
+    return true;
+}
+
+// Kept cache files other than the open one, oldest mtime first, until the
+// directory fits the limit
+void TilePyramid::evict() {
+    if (cacheDir_.empty())
+        return;
+    struct Entry {
+        fs::path path;
+        fs::file_time_type time;
+        uintmax_t bytes;
+    };
+    vector<Entry> entries;
+    uintmax_t total = 0;
+    error_code ec;
+    for (const auto& file : fs::directory_iterator(cacheDir_, ec)) {
+        string name = file.path().filename().string();
+        if (name.compare(0, 12, "image_tiles_") != 0)
+            continue;
+        Entry entry = { file.path(), file.last_write_time(ec), file.file_size(ec) };
+        if (ec)
+            continue;
+        total += entry.bytes;
+        if (!fs::equivalent(entry.path, cachePath_, ec))
+            entries.push_back(entry);
+    }
+    sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.time < b.time; });
+    for (const Entry& entry : entries) {
+        if (total <= maxCacheBytes_)
+            break;
+        if (fs::remove(entry.path, ec))
+            total -= entry.bytes;
+    }
+}
+
+bool TilePyramid::build(const string& imagePath, uint64_t sourceBytes, int64_t sourceTime) {
+    unique_ptr<StripReader> reader = openStripReader(imagePath);
+    if (!reader)
+        return false;
+    Size size = reader->size();
+    if (size.width <= 0 || size.height <= 0)
+        return false;
+    size_t fileSize = layout(size);
+    if (!file_.create(cachePath_, fileSize))
+        return false;
+
+    // Rows collected per level until they fill a row of tiles. Each full row
+    // of tiles is halved into the next level, so no level is ever held whole.
+    int n = levels();
+    vector<Mat> pending(n);
+    vector<int> filled(n, 0), tileRow(n, 0);
+    for (int l = 0; l < n; l++)
+        pending[l].create(tileSize, levels_[l].size.width, CV_8UC3);
+
+    function<void(int)> emitRow;
+    auto push = [&](int l, const Mat& rows) {
+        for (int done = 0; done < rows.rows;) {
+            int count = min(rows.rows - done, tileSize - filled[l]);
+            rows.rowRange(done, done + count).copyTo(pending[l].rowRange(filled[l], filled[l] + count));
+            filled[l] += count;
+            done += count;
+            if (filled[l] == tileSize)
+                emitRow(l);
+        }
+    };
+    emitRow = [&](int l) {
+        const Level& lv = levels_[l];
+        Mat rows = pending[l].rowRange(0, filled[l]);
+        for (int tx = 0; tx < lv.tilesX; tx++) {
+            int x = tx * tileSize, w = min(tileSize, lv.size.width - x);
+            Mat dst(tileSize, tileSize, CV_8UC3, tileData(l, tx, tileRow[l]));
+            rows.colRange(x, x + w).copyTo(dst(Rect(0, 0, w, rows.rows)));
+        }
+        tileRow[l]++;
+        filled[l] = 0;
+        if (l + 1 < n) {
+            Mat half;
+            resize(rows, half, Size(levels_[l + 1].size.width, (rows.rows + 1) / 2), 0, 0, INTER_AREA);
+            push(l + 1, half);
+        }
+    };
+
+    Mat strip(tileSize, size.width, CV_8UC3);
+    for (int y = 0; y < size.height;) {
+        int rows = reader->read(strip);
+        if (rows <= 0)
+            return false; // truncated image
+        push(0, strip.rowRange(0, rows));
+        y += rows;
+    }
+    // Last, partial rows of tiles, finest level first as each feeds the next
+    for (int l = 0; l < n; l++) {
+        if (filled[l] > 0)
+            emitRow(l);
+    }
+
+    CacheHeader* header = (CacheHeader*)file_.data();
+    memcpy(header->magic, cacheMagic, sizeof(cacheMagic));
+    header->sourceBytes = sourceBytes;
+    header->sourceTime = sourceTime;
+    header->width = size.width;
+    header->height = size.height;
+    header->tileSize = tileSize;
+    header->fileSize = fileSize;
+    if (!file_.flush())
+        return false;
+    header->complete = 1;
+    return file_.flush();
+}
+
+const Mat& TilePyramid::tile(int level, int tx, int ty) {
+    uint64_t id = ((uint64_t)level << 48) | ((uint64_t)ty << 24) | (uint64_t)tx;
+    auto it = tiles_.find(id);
+    if (it != tiles_.end()) {
+        recent_.splice(recent_.begin(), recent_, it->second.second);
+        return it->second.first;
+    }
+    if (tiles_.size() >= cacheTiles_) {
+        tiles_.erase(recent_.back());
+        recent_.pop_back();
+    }
+    recent_.push_front(id);
+    auto& entry = tiles_[id];
+    entry.first = Mat(tileSize, tileSize, CV_8UC3, tileData(level, tx, ty)).clone();
+    entry.second = recent_.begin();
+    return entry.first;
+}
+
+Mat TilePyramid::render(const Rect2d& view, Size out, int interpolation) {
+    Mat result(out, CV_8UC3, Scalar::all(0));
+    if (!isOpen() || out.width <= 0 || out.height <= 0 || view.width <= 0 || view.height <= 0)
+        return result;
+
+    // Coarsest level with at least one pixel per output pixel
+    double density = min(view.width / out.width, view.height / out.height);
+    int level = 0;
+    while (level + 1 < levels() && density >= 2.0) {
+        density /= 2;
+        level++;
+    }
+    const Level& lv = levels_[level];
+    double fx = (double)lv.size.width / levels_[0].size.width;
+    double fy = (double)lv.size.height / levels_[0].size.height;
+    double x0 = view.x * fx, y0 = view.y * fy;
+    double x1 = (view.x + view.width) * fx, y1 = (view.y + view.height) * fy;
+    if (x1 <= 0 || y1 <= 0 || x0 >= lv.size.width || y0 >= lv.size.height)
+        return result;
+
+    // Tiles under the view, with a pixel of margin for interpolation
+    int tx0 = min(max(cvFloor((x0 - 1) / tileSize), 0), lv.tilesX - 1);
+    int ty0 = min(max(cvFloor((y0 - 1) / tileSize), 0), lv.tilesY - 1);
+    int tx1 = min(max(cvFloor((x1 + 1) / tileSize), 0), lv.tilesX - 1);
+    int ty1 = min(max(cvFloor((y1 + 1) / tileSize), 0), lv.tilesY - 1);
+    Mat canvas((ty1 - ty0 + 1) * tileSize, (tx1 - tx0 + 1) * tileSize, CV_8UC3);
+    lock_guard<mutex> lock(cacheMutex_);
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++)
+            tile(level, tx, ty).copyTo(canvas(Rect((tx - tx0) * tileSize, (ty - ty0) * tileSize, tileSize, tileSize)));
+    }
+
+    // Output pixel centres mapped back onto the canvas
+    double sx = (x1 - x0) / out.width, sy = (y1 - y0) / out.height;
+    Mat toCanvas(2, 3, CV_64F, Scalar::all(0));
+    toCanvas.at<double>(0, 0) = sx;
+    toCanvas.at<double>(0, 2) = x0 - tx0 * tileSize + 0.5 * sx - 0.5;
+    toCanvas.at<double>(1, 1) = sy;
+    toCanvas.at<double>(1, 2) = y0 - ty0 * tileSize + 0.5 * sy - 0.5;
+    warpAffine(canvas, result, toCanvas, out, interpolation | WARP_INVERSE_MAP, BORDER_CONSTANT, Scalar::all(0));
+    return result;
+}
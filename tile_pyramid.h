@@ -0,0 +1,78 @@
+#pragma once
+
+#include "mapped_file.h"
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Multi-resolution tiles of one BGR image, for viewers that only ever show a
+// window of it. Level 0 is the full image and each further level halves it
+// (INTER_AREA) until it fits in one tile. The tiles are built once, strip by
+// strip, into a cache file. Tiles are stored raw, so a cache miss is a copy
+// out of the mapping, not a decode. Images that openStripReader() cannot
+// stream are decoded whole once while the file is built.
+class TilePyramid {
+public:
+    static const int tileSize = 256;
+
+    TilePyramid() {}
+    TilePyramid(const TilePyramid&) = delete;
+    TilePyramid& operator=(const TilePyramid&) = delete;
+    ~TilePyramid() { close(); }
+
+    // Keeps cache files in dir, so later opens of the same image map them and
+    // skip the decode. Once the files there take more than maxBytes, the least
+    // recently opened ones are deleted. Without a cache dir, the file is built
+    // in the temp directory and deleted by close().
+    void setCacheDir(const std::string& dir, size_t maxBytes);
+
+    // Maps the cache file for imagePath, building it first when it is missing
+    // or was made from another version of the image. cacheTiles bounds the
+    // tiles kept in memory. Returns false if the image or cache cannot be read.
+    bool open(const std::string& imagePath, size_t cacheTiles = 256);
+    void close();
+    bool isOpen() const { return file_.data() != nullptr; }
+
+    int levels() const { return (int)levels_.size(); }
+    cv::Size size(int level = 0) const { return levels_[level].size; }
+    const std::string& cachePath() const { return cachePath_; }
+
+    // One tileSize x tileSize tile; past the image edge it is black. Not
+    // thread-safe, unlike render().
+    const cv::Mat& tile(int level, int tx, int ty);
+
+    // The region view of the full-size image, scaled to out. Only the tiles of
+    // the level nearest the output resolution under view are read, so the
+    // cost depends on the output size alone. Outside the image is black.
+    cv::Mat render(const cv::Rect2d& view, cv::Size out, int interpolation = cv::INTER_LINEAR);
+
+private:
+    struct Level {
+        cv::Size size;
+        int tilesX = 0, tilesY = 0;
+        size_t offset = 0; // of tile (0, 0) in the cache file
+    };
+
+    size_t layout(cv::Size imageSize); // returns the cache file size
+    bool build(const std::string& imagePath, uint64_t sourceBytes, int64_t sourceTime);
+    uchar* tileData(int level, int tx, int ty) const;
+    void evict();
+
+    MappedFile file_;
+    std::string cacheDir_;     // empty: temporary file
+    size_t maxCacheBytes_ = 0;
+    std::string cachePath_;
+    std::vector<Level> levels_;
+
+    // LRU of tiles copied out of the mapping: most recent first
+    std::mutex cacheMutex_;
+    size_t cacheTiles_ = 256;
+    std::list<uint64_t> recent_;
+    std::unordered_map<uint64_t, std::pair<cv::Mat, std::list<uint64_t>::iterator>> tiles_;
+};
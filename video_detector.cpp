@@ -0,0 +1,312 @@
+#include "video_detector.h"
+
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <climits>
+
+using namespace cv;
+using namespace std;
+
+static double elapsedMs(int64 start) {
+    return (getTickCount() - start) * 1000.0 / getTickFrequency();
+}
+
+static bool sameClusters(const vector<vector<ClonePair>>& a, const vector<vector<ClonePair>>& b) {
+    if (a.size() != b.size())
+        return false;
+    for (size_t c = 0; c < a.size(); c++) {
+        if (a[c].size() != b[c].size())
+            return false;
+        for (size_t i = 0; i < a[c].size(); i++) {
+            if (a[c][i].src != b[c][i].src || a[c][i].dst != b[c][i].dst)
+                return false;
+        }
+    }
+    return true;
+}
+
+VideoCloneDetector::VideoCloneDetector(const VideoParams& params) : params_(params) {
+    params_.clone.blockSize = max(1, params_.clone.blockSize);
+    params_.clone.stepSize = max(1, params_.clone.stepSize);
+    params_.tileSize = max(1, params_.tileSize);
+    params_.clone.matchMode = MATCH_FIRST;
+    params_.clone.matchEngine = ENGINE_HASH;
+    params_.clone.keyMatcher = MATCHER_HASH_TABLE;
+    params_.clone.pyramidLevels = 0;
+}
+
+void VideoCloneDetector::reset() {
+    restart(Size());
+}
+
+void VideoCloneDetector::restart(Size size) {
+    int blockSize = params_.clone.blockSize, stepSize = params_.clone.stepSize;
+    frameSize_ = size;
+    blockCols_ = blockRows_ = 0;
+    if (size.width >= blockSize && size.height >= blockSize) {
+        blockCols_ = (size.width - blockSize) / stepSize + 1;
+        blockRows_ = (size.height - blockSize) / stepSize + 1;
+    }
+    tilesX_ = (size.width + params_.tileSize - 1) / params_.tileSize;
+    tilesY_ = (size.height + params_.tileSize - 1) / params_.tileSize;
+    size_t blocks = (size_t)blockCols_ * blockRows_;
+
+    keyedGray_.release();
+    dirty_.assign(blocks, 1);
+    table_ = BlockTable();
+    bucketKey_.clear();
+    bucketSize_.clear();
+    emptyBuckets_ = 0;
+    bucketOf_.assign(blocks, -1);
+    keyedBlocks_ = 0;
+    result_ = CloneResult();
+    result_.blockSize = blockSize;
+    frameIndex_ = 0;
+    segments_.clear();
+    segmentOpen_ = false;
+    stats_ = VideoStats();
+}
+
+// Compares each tile with the tile as last keyed; changed tiles become the
+// new reference and mark every block that overlaps them
+void VideoCloneDetector::markDirtyBlocks(const Mat& gray) {
+    stats_.tilesTotal += (size_t)tilesX_ * tilesY_;
+    if (keyedGray_.empty()) {
+        keyedGray_ = gray.clone();
+        stats_.tilesChanged += (size_t)tilesX_ * tilesY_;
+        return; // restart() marked every block
+    }
+    int blockSize = params_.clone.blockSize, stepSize = params_.clone.stepSize;
+    int tileSize = params_.tileSize;
+    Mat diff;
+    absdiff(gray, keyedGray_, diff);
+    for (int ty = 0; ty < tilesY_; ty++) {
+        for (int tx = 0; tx < tilesX_; tx++) {
+            int x0 = tx * tileSize, y0 = ty * tileSize;
+            Rect tile(x0, y0, min(tileSize, gray.cols - x0), min(tileSize, gray.rows - y0));
+            if (mean(diff(tile))[0] <= params_.changeThreshold)
+                continue;
+            gray(tile).copyTo(keyedGray_(tile));
+            stats_.tilesChanged++;
+
+            // Blocks [x, x + blockSize) that meet [x0, x1) start in (x0 - blockSize, x1)
+            int x1 = x0 + tile.width, y1 = y0 + tile.height;
+            int c0 = max(0, (x0 - blockSize + stepSize) / stepSize), c1 = min(blockCols_, (x1 - 1) / stepSize + 1);
+            int r0 = max(0, (y0 - blockSize + stepSize) / stepSize), r1 = min(blockRows_, (y1 - 1) / stepSize + 1);
+            for (int r = r0; r < r1; r++)
+                fill(dirty_.begin() + (size_t)r * blockCols_ + c0, dirty_.begin() + (size_t)r * blockCols_ + c1, 1);
+        }
+    }
+}
+
+// Keys of blocks[first, last), which start on one row of tiles. The detail
+// and sample maps cover just those blocks, plus a pixel of context so the
+// Laplacian matches the one of the whole frame.
+void VideoCloneDetector::keyBlocks(const Mat& frame, const vector<int>& blocks, size_t first, size_t last,
+                                   vector<uint64_t>& keys, vector<uchar>& kept) const {
+    const CloneParams& cp = params_.clone;
+    int left = INT_MAX, right = 0;
+    for (size_t k = first; k < last; k++) {
+        int x = (blocks[k] % blockCols_) * cp.stepSize;
+        left = min(left, x);
+        right = max(right, x + cp.blockSize);
+    }
+    int top = (blocks[first] / blockCols_) * cp.stepSize;
+    int bottom = (blocks[last - 1] / blockCols_) * cp.stepSize + cp.blockSize;
+    Rect region = Rect(left - 1, top - 1, right - left + 2, bottom - top + 2) & Rect(Point(), frame.size());
+
+    bool integral = cp.detailEngine == DETAIL_INTEGRAL;
+    bool sampled = cp.keyEngine == KEY_SAMPLE_MAP && SampleMap::supports(cp.blockSize);
+    DetailMap detailMap;
+    SampleMap sampleMap;
+    if (integral)
+        detailMap.compute(frame(region));
+    if (sampled)
+        sampleMap.compute(frame(region), SampleMap::windowFor(cp.blockSize));
+    parallel_for_(Range((int)first, (int)last), [&](const Range& r) {
+        Mat compressed;
+        uchar cells[16];
+        for (int k = r.start; k < r.end; k++) {
+            int i = blocks[k];
+            int x = (i % blockCols_) * cp.stepSize, y = (i / blockCols_) * cp.stepSize;
+            Mat block = frame(Rect(x, y, cp.blockSize, cp.blockSize));
+            double detail = integral ? detailMap.blockDetail(x - region.x, y - region.y, cp.blockSize)
+                                     : computeDetail(block);
+            if (detail < cp.detailThreshold)
+                continue;
+            keys[k] = sampled ? sampleMap.blockKey(x - region.x, y - region.y, cp.blockSize, cells)
+                              : blockToKey(block, compressed);
+            kept[k] = 1;
+        }
+    });
+}
+
+void VideoCloneDetector::link(int block, uint64_t key) {
+    Point found;
+    int b = (int)bucketKey_.size();
+    if (table_.findOrInsert(key, Point(b, 0), found)) {
+        b = found.x;
+        if (bucketSize_[b] == 0)
+            emptyBuckets_--;
+    } else {
+        bucketKey_.push_back(key);
+        bucketSize_.push_back(0);
+    }
+    bucketOf_[block] = b;
+    bucketSize_[b]++;
+    keyedBlocks_++;
+}
+
+void VideoCloneDetector::unlink(int block) {
+    int b = bucketOf_[block];
+    if (b < 0)
+        return;
+    bucketOf_[block] = -1;
+    if (--bucketSize_[b] == 0)
+        emptyBuckets_++;
+    keyedBlocks_--;
+}
+
+// BlockTable has no erase, so keys that left every block stay behind. Once
+// they outnumber the live ones, the table is rebuilt from the live buckets.
+void VideoCloneDetector::compactBuckets() {
+    size_t live = bucketKey_.size() - emptyBuckets_;
+    if (emptyBuckets_ <= max(live, (size_t)1024))
+        return;
+    vector<int> remap(bucketKey_.size(), -1);
+    BlockTable table;
+    table.reserve(live);
+    vector<uint64_t> keys;
+    vector<int> sizes;
+    for (size_t b = 0; b < bucketKey_.size(); b++) {
+        if (bucketSize_[b] == 0)
+            continue;
+        remap[b] = (int)keys.size();
+        Point found;
+        table.findOrInsert(bucketKey_[b], Point(remap[b], 0), found);
+        keys.push_back(bucketKey_[b]);
+        sizes.push_back(bucketSize_[b]);
+    }
+    for (int& b : bucketOf_) {
+        if (b >= 0)
+            b = remap[b];
+    }
+    table_ = move(table);
+    bucketKey_.swap(keys);
+    bucketSize_.swap(sizes);
+    emptyBuckets_ = 0;
+}
+
+// Pairs every keyed block with the first block of its key, in raster order,
+// as the MATCH_FIRST scan of a single image would
+void VideoCloneDetector::matchBlocks() {
+    int stepSize = params_.clone.stepSize;
+    result_.candidatePairs.clear();
+    size_t rejected = 0;
+    vector<int> firstBlock(bucketKey_.size(), -1);
+    for (int i = 0; i < (int)bucketOf_.size(); i++) {
+        int b = bucketOf_[i];
+        if (b < 0)
+            continue;
+        if (firstBlock[b] < 0) {
+            firstBlock[b] = i;
+            continue;
+        }
+        int head = firstBlock[b];
+        Point src((head % blockCols_) * stepSize, (head / blockCols_) * stepSize);
+        Point dst((i % blockCols_) * stepSize, (i / blockCols_) * stepSize);
+        if (euclideanDistance(src, dst) < params_.clone.minDistance)
+            rejected++;
+        else
+            result_.candidatePairs.push_back({ src, dst });
+    }
+    result_.stats.rejectedByDistance = rejected;
+    result_.stats.candidatePairs = result_.candidatePairs.size();
+}
+
+const CloneResult& VideoCloneDetector::addFrame(const Mat& frame) {
+    const CloneParams& cp = params_.clone;
+    bool fresh = frame.size() != frameSize_;
+    if (fresh)
+        restart(frame.size());
+    CloneStats& st = result_.stats;
+
+    int64 t = getTickCount();
+    Mat gray;
+    cvtColor(frame, gray, COLOR_BGR2GRAY);
+    markDirtyBlocks(gray);
+    stats_.changeMs += elapsedMs(t);
+
+    // New keys of the marked blocks, one row of tiles at a time, then bucket
+    // moves in block order
+    t = getTickCount();
+    vector<int> blocks;
+    for (size_t i = 0; i < dirty_.size(); i++) {
+        if (dirty_[i])
+            blocks.push_back((int)i);
+    }
+    fill(dirty_.begin(), dirty_.end(), 0);
+    vector<uint64_t> keys(blocks.size());
+    vector<uchar> kept(blocks.size(), 0);
+    for (size_t first = 0; first < blocks.size();) {
+        int tileRow = (blocks[first] / blockCols_) * cp.stepSize / params_.tileSize;
+        size_t last = first + 1;
+        while (last < blocks.size() && (blocks[last] / blockCols_) * cp.stepSize / params_.tileSize == tileRow)
+            last++;
+        keyBlocks(frame, blocks, first, last, keys, kept);
+        first = last;
+    }
+    bool changed = fresh;
+    size_t filtered = 0;
+    for (size_t k = 0; k < blocks.size(); k++) {
+        int i = blocks[k], b = bucketOf_[i];
+        if (!kept[k])
+            filtered++;
+        if (kept[k] && b >= 0 && bucketKey_[b] == keys[k])
+            continue;
+        if (b >= 0 || kept[k])
+            changed = true;
+        unlink(i);
+        if (kept[k])
+            link(i, keys[k]);
+    }
+    compactBuckets();
+    st.blocksVisited = blocks.size();
+    st.blocksFiltered = filtered;
+    st.uniqueKeys = bucketKey_.size() - emptyBuckets_;
+    st.keyCollisions = keyedBlocks_ - st.uniqueKeys;
+    st.probeCollisions = table_.probes;
+    st.scanMs = elapsedMs(t);
+    stats_.rekeyMs += st.scanMs;
+    stats_.blocksRekeyed += blocks.size();
+    stats_.blocksTotal += (size_t)blockCols_ * blockRows_;
+
+    // Unchanged buckets give the previous frame's pairs and clusters again
+    if (changed) {
+        t = getTickCount();
+        matchBlocks();
+        st.matchMs = elapsedMs(t);
+        stats_.matchMs += st.matchMs;
+
+        t = getTickCount();
+        result_.clusters = clusterClones(result_.candidatePairs, cp.minClusterSize,
+                                         cp.directionTolerance, cp.mergeReversed);
+        st.clustersKept = result_.clusters.size();
+        st.clusterMs = elapsedMs(t);
+        stats_.clusterMs += st.clusterMs;
+    } else {
+        st.matchMs = st.clusterMs = 0;
+    }
+
+    if (result_.clusters.empty()) {
+        segmentOpen_ = false;
+    } else if (segmentOpen_ && (!changed || sameClusters(segments_.back().clusters, result_.clusters))) {
+        segments_.back().lastFrame = frameIndex_;
+    } else {
+        segments_.push_back({ frameIndex_, frameIndex_, result_.clusters });
+        segmentOpen_ = true;
+    }
+    frameIndex_++;
+    stats_.frames++;
+    return result_;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "clone_detector.h"
+
+#include <opencv2/core.hpp>
+#include <vector>
+
+struct VideoParams {
+    // Block, detail, distance and cluster settings, and the detail and key
+    // engines. Matching is always MATCH_FIRST on exact keys.
+    CloneParams clone;
+    int tileSize = 64;            // change detection grid, in pixels
+    double changeThreshold = 2.0; // mean absolute gray difference that marks a tile changed
+};
+
+// Consecutive frames that share the same clusters
+struct CloneSegment {
+    int firstFrame = 0, lastFrame = 0;
+    std::vector<std::vector<ClonePair>> clusters;
+};
+
+struct VideoStats {
+    size_t frames = 0;
+    size_t tilesChanged = 0, tilesTotal = 0;
+    size_t blocksRekeyed = 0, blocksTotal = 0;
+    double changeMs = 0, rekeyMs = 0, matchMs = 0, clusterMs = 0;
+};
+
+// Copy-move detection over a sequence of frames. The frame is split into
+// tiles, and a tile whose mean gray difference from the last time it was
+// keyed exceeds changeThreshold marks the blocks over it for re-keying. The
+// marked blocks of each row of tiles are keyed from detail and sample maps
+// of just the region under them. The key index lives across frames: every
+// key has a bucket that counts its blocks, so re-keying a block moves it
+// between two buckets in O(1), and the pairing pass over the blocks in
+// raster order finds each key's first block. A frame that re-keys nothing
+// reuses the previous frame's pairs and clusters. With changeThreshold 0,
+// each frame's result equals CloneDetector::detect() with MATCH_FIRST and
+// the same detail and key engines on it.
+class VideoCloneDetector {
+public:
+    explicit VideoCloneDetector(const VideoParams& params = VideoParams());
+
+    // Expects BGR frames of one size; a new size starts over, as after reset()
+    const CloneResult& addFrame(const cv::Mat& frame);
+    // Forgets all frames, segments and counters, for the next video
+    void reset();
+    const CloneResult& result() const { return result_; }
+
+    // Frame ranges with at least one cluster, the last one possibly still open
+    const std::vector<CloneSegment>& segments() const { return segments_; }
+    const VideoStats& stats() const { return stats_; }
+    // As given, with the matching settings that do not apply overridden
+    const VideoParams& params() const { return params_; }
+
+private:
+    void restart(cv::Size size);
+    void markDirtyBlocks(const cv::Mat& gray);
+    void keyBlocks(const cv::Mat& frame, const std::vector<int>& blocks, size_t first, size_t last,
+                   std::vector<uint64_t>& keys, std::vector<uchar>& kept) const;
+    void link(int block, uint64_t key);
+    void unlink(int block);
+    void compactBuckets();
+    void matchBlocks();
+
+    VideoParams params_;
+    cv::Size frameSize_;
+    int blockCols_ = 0, blockRows_ = 0;
+    int tilesX_ = 0, tilesY_ = 0;
+    int frameIndex_ = 0;
+    cv::Mat keyedGray_;             // each tile as it was when last keyed
+    std::vector<uchar> dirty_;      // per block
+
+    // Buckets: key -> bucket id in the table's slot x, with its block count
+    BlockTable table_;
+    std::vector<uint64_t> bucketKey_;
+    std::vector<int> bucketSize_;
+    size_t emptyBuckets_ = 0;       // still in table_, reused if their key returns
+    std::vector<int> bucketOf_;     // per block, -1 = none
+    size_t keyedBlocks_ = 0;        // blocks in some bucket
+
+    CloneResult result_;
+    std::vector<CloneSegment> segments_;
+    bool segmentOpen_ = false;
+    VideoStats stats_;
+};